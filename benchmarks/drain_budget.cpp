@@ -0,0 +1,145 @@
+
+// A microbenchmark of the drain budget (the maximum number of replies processed per wakeup of a thread)
+// A child process registers many services and a browse is timed finding them all at each budget
+// Wakeups are counted from the lock profile (each wakeup of a thread takes its lock once)
+// N.B. Build from this directory with: c++ -std=c++17 -O2 -I.. drain_budget.cpp -o drain_budget -lpthread
+// N.B. Linux builds (against Avahi or mDNSResponder) also need -ldns_sd
+
+#define BONJOUR_FOR_CPP_LOCK_STATS
+
+#include "bonjour-for-cpp.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const char *regtype = "_drainbench._tcp";
+
+static std::atomic<int> replies(0);
+
+static void add(bonjour_browse *, const char *, const char *, const char *, bool)
+{
+    replies++;
+}
+
+// Registers the services and reports over the pipe once all are registered (then waits to be killed)
+
+static void register_services(int count, int fd)
+{
+    std::list<std::unique_ptr<bonjour_register>> services;
+    
+    for (int i = 0; i < count; i++)
+    {
+        std::string name = "bench " + std::to_string(getppid()) + " " + std::to_string(i);
+        services.emplace_back(new bonjour_register(name.c_str(), regtype, "", htons(9000 + i)));
+        services.back()->start();
+    }
+    
+    auto deadline = bonjour_clock::now() + std::chrono::seconds(30);
+    
+    for (auto it = services.begin(); it != services.end() && bonjour_clock::now() < deadline; )
+    {
+        if ((*it)->registered())
+            it++;
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    
+    char result = bonjour_clock::now() < deadline ? 1 : 0;
+    
+    if (write(fd, &result, 1) != 1)
+        _exit(1);
+    
+    while (true)
+        pause();
+}
+
+static uint64_t thread_wakeups()
+{
+    std::list<bonjour_lock_stats> stats;
+    bonjour_lock_profile::stats(stats);
+    
+    for (auto it = stats.begin(); it != stats.end(); it++)
+        if (it->m_class == "bonjour_thread")
+            return it->m_acquisitions;
+    
+    return 0;
+}
+
+// Browses until every service is found (only the browse runs a thread in this process)
+
+static void run(int budget, int count)
+{
+    bonjour_browse::notify_type notify;
+    notify.m_add = add;
+    
+    bonjour_base::set_drain_budget(budget);
+    bonjour_lock_profile::reset();
+    replies = 0;
+    
+    bonjour_browse browse(regtype, "", notify);
+    
+    auto start = bonjour_clock::now();
+    auto deadline = start + std::chrono::seconds(10);
+    
+    browse.start();
+    
+    while (replies < count && bonjour_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    
+    double ms = std::chrono::duration<double, std::milli>(bonjour_clock::now() - start).count();
+    uint64_t wakeups = thread_wakeups();
+    int found = replies;
+    
+    browse.stop();
+    
+    printf("%6d %8d %8llu %16.2f %10.2f\n", budget, found, static_cast<unsigned long long>(wakeups),
+           wakeups ? static_cast<double>(found) / wakeups : 0.0, ms);
+}
+
+int main(int argc, const char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 200;
+    int fds[2];
+    char result = 0;
+    
+    // Fork before any threads are started (so the registrations' threads are not counted)
+    
+    if (count < 1 || pipe(fds))
+        return 1;
+    
+    pid_t child = fork();
+    
+    if (child < 0)
+        return 1;
+    
+    if (!child)
+        register_services(count, fds[1]);
+    
+    if (read(fds[0], &result, 1) != 1 || !result)
+    {
+        fprintf(stderr, "failed to register %d services\n", count);
+        kill(child, SIGKILL);
+        return 1;
+    }
+    
+    printf("%6s %8s %8s %16s %10s\n", "budget", "replies", "wakeups", "replies/wakeup", "ms");
+    
+    const int budgets[] = { 1, 4, 16, 64, 256 };
+    
+    for (int budget : budgets)
+        run(budget, count);
+    
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    
+    return 0;
+}
@@ -3,9 +3,16 @@
 #define BONJOUR_FOR_CPP_HPP
 
 #include "bonjour_named.hpp"
+#include "bonjour_address.hpp"
 #include "bonjour_service.hpp"
 #include "bonjour_register.hpp"
+#include "bonjour_record_register.hpp"
 #include "bonjour_browse.hpp"
+#include "bonjour_timer.hpp"
 #include "bonjour_peer.hpp"
+#include "bonjour_service_type.hpp"
+#include "bonjour_scheduler.hpp"
+#include "bonjour_txt_schema.hpp"
+#include "bonjour_events.hpp"
 
 #endif /* BONJOUR_FOR_CPP_HPP */
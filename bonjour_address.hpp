@@ -0,0 +1,100 @@
+
+#ifndef BONJOUR_ADDRESS_HPP
+#define BONJOUR_ADDRESS_HPP
+
+#include "bonjour_base.hpp"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// An object for looking up the address of a host (such as a host reported by resolving a service)
+
+class bonjour_address : public bonjour_base
+{
+public:
+    
+    static constexpr auto service = DNSServiceGetAddrInfo;
+    
+    using callback = DNSServiceGetAddrInfoReply;
+    using callback_type = make_callback_type<bonjour_address, 3, 1, 4, 5>;
+    
+    friend callback_type;
+    
+    struct notify_type
+    {
+        notify_type() : m_stop(nullptr), m_address(nullptr) {}
+        
+        bonjour_notify<bonjour_address>::stop_type m_stop = nullptr;
+        bonjour_notify<bonjour_address>::address_type m_address = nullptr;
+        
+        bonjour_executor m_executor;
+    };
+    
+    bonjour_address(const char *host, notify_type notify = notify_type())
+    : bonjour_base("", "")
+    , m_host(host)
+    , m_notify(notify)
+    {
+        impl::set_lock_class(m_mutex, "bonjour_address");
+        set_executor(notify.m_executor);
+    }
+    
+    ~bonjour_address()
+    {
+        stop();
+        end_notifications();
+    }
+    
+    bonjour_address(bonjour_address const& rhs) = delete;
+    bonjour_address(bonjour_address const&& rhs) = delete;
+    void operator = (bonjour_address const& rhs) = delete;
+    void operator = (bonjour_address const&& rhs) = delete;
+    
+    bool lookup()
+    {
+        return spawn(this, kDNSServiceProtocol_IPv4 | kDNSServiceProtocol_IPv6, m_host.c_str());
+    }
+    
+    const char *host() const
+    {
+        return m_host.c_str();
+    }
+    
+    std::string address() const
+    {
+        mutex_lock lock(m_mutex);
+        std::string str(m_address);
+        return str;
+    }
+    
+private:
+    
+    void reply(DNSServiceFlags flags, const char *host, const struct sockaddr *address)
+    {
+        bool complete = (flags & kDNSServiceFlagsMoreComing) == 0;
+        
+        if (!(flags & kDNSServiceFlagsAdd) || !address || !m_address.empty())
+            return;
+        
+        char str[NI_MAXHOST];
+        
+        socklen_t length = address->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+        
+        if (getnameinfo(address, length, str, sizeof(str), nullptr, 0, NI_NUMERICHOST))
+            return;
+        
+        m_address = str;
+        
+        stop();
+        
+        notify(bonjour_callback::address, m_notify.m_address, this, host, str, complete);
+    }
+    
+    std::string m_host;
+    std::string m_address;
+    
+    notify_type m_notify;
+};
+
+#endif /* BONJOUR_ADDRESS_HPP */
@@ -0,0 +1,973 @@
+
+#ifndef BONJOUR_AGENT_HPP
+#define BONJOUR_AGENT_HPP
+
+#include "bonjour_peer.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// The wire format between the agent and its clients
+// Each message is a 32 bit length (covering the rest of the message) followed by a one byte type
+// Strings are sent as a 16 bit length followed by the characters (without a terminator)
+// Clients that register are sent the name actually registered once it is known (or a failure if it cannot be)
+
+namespace impl
+{
+    namespace agent_protocol
+    {
+        enum message : uint8_t { subscribe = 'S', add = 'A', remove = 'R', registered = 'N', failed = 'F' };
+        
+        inline void write_u16(std::string& buffer, uint16_t value)
+        {
+            buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+        
+        inline void write_string(std::string& buffer, const char *str)
+        {
+            auto length = static_cast<uint16_t>(strnlen(str, 0xFFFF));
+            
+            write_u16(buffer, length);
+            buffer.append(str, length);
+        }
+        
+        inline void begin(std::string& buffer, message type, size_t& start)
+        {
+            uint32_t length = 0;
+            
+            start = buffer.size();
+            buffer.append(reinterpret_cast<const char *>(&length), sizeof(length));
+            buffer.push_back(static_cast<char>(type));
+        }
+        
+        inline void end(std::string& buffer, size_t start)
+        {
+            uint32_t length = static_cast<uint32_t>(buffer.size() - start - sizeof(length));
+            buffer.replace(start, sizeof(length), reinterpret_cast<const char *>(&length), sizeof(length));
+        }
+        
+        // A reader over a single received message
+        
+        class reader
+        {
+        public:
+            
+            reader(const char *data, size_t size) : m_data(data), m_size(size), m_valid(true) {}
+            
+            uint16_t read_u16()
+            {
+                uint16_t value = 0;
+                
+                if (check(sizeof(value)))
+                {
+                    memcpy(&value, m_data, sizeof(value));
+                    skip(sizeof(value));
+                }
+                
+                return value;
+            }
+            
+            std::string read_string()
+            {
+                auto length = read_u16();
+                
+                if (!check(length))
+                    return std::string();
+                
+                std::string str(m_data, length);
+                skip(length);
+                return str;
+            }
+            
+            bool valid() const { return m_valid; }
+        
+        private:
+            
+            bool check(size_t size)
+            {
+                m_valid = m_valid && size <= m_size;
+                return m_valid;
+            }
+            
+            void skip(size_t size)
+            {
+                m_data += size;
+                m_size -= size;
+            }
+            
+            const char *m_data;
+            size_t m_size;
+            bool m_valid;
+        };
+        
+        // Extracts complete messages from a receive buffer, calling the handler with the type and a reader
+        
+        template <class T>
+        bool parse(std::string& buffer, T handler)
+        {
+            size_t offset = 0;
+            
+            while (buffer.size() - offset >= sizeof(uint32_t) + 1)
+            {
+                uint32_t length;
+                
+                memcpy(&length, buffer.data() + offset, sizeof(length));
+                
+                if (length < 1 || length > 0x100000)
+                    return false;
+                
+                if (buffer.size() - offset - sizeof(length) < length)
+                    break;
+                
+                auto data = buffer.data() + offset + sizeof(length);
+                
+                reader r(data + 1, length - 1);
+                
+                if (!handler(static_cast<message>(data[0]), r))
+                    return false;
+                
+                offset += sizeof(length) + length;
+            }
+            
+            buffer.erase(0, offset);
+            return true;
+        }
+        
+        inline bool send_all(int socket, std::string& buffer)
+        {
+            while (!buffer.empty())
+            {
+                auto sent = send(socket, buffer.data(), buffer.size(), MSG_NOSIGNAL);
+                
+                if (sent < 0)
+                    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+                
+                buffer.erase(0, sent);
+            }
+            
+            return true;
+        }
+        
+        inline bool receive_all(int socket, std::string& buffer)
+        {
+            char data[4096];
+            
+            while (true)
+            {
+                auto received = recv(socket, data, sizeof(data), 0);
+                
+                if (received > 0)
+                    buffer.append(data, received);
+                else if (received == 0)
+                    return false;
+                else
+                    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+        }
+        
+        inline sockaddr_un address(const char *path)
+        {
+            sockaddr_un addr;
+            
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+            
+            return addr;
+        }
+    }
+}
+
+// A local discovery agent that owns all discovery operations on a host
+// Clients (bonjour_agent_peer) connect over a Unix domain socket and receive add/remove deltas for their regtype
+// Each distinct regtype/domain is browsed and resolved once, however many clients subscribe to it
+// The socket is created with the given mode (by default only the owner can connect)
+
+class bonjour_agent
+{
+    // A browse (with resolution) shared by all clients subscribing to the same regtype and domain
+    
+    struct subscription
+    {
+        subscription(const std::string& regtype, const std::string& domain, int wake)
+        : m_regtype(regtype)
+        , m_domain(domain)
+        , m_peer("", regtype.c_str(), domain.c_str(), 0, options())
+        , m_signal(std::make_shared<impl::change_signal>())
+        , m_generation(0)
+        {
+            m_signal->wake(wake);
+            m_peer.observe(m_signal);
+            m_peer.start();
+        }
+        
+        static bonjour_peer_options options()
+        {
+            bonjour_peer_options options;
+            
+            options.m_mode = bonjour_peer_options::modes::browse_only;
+            options.m_self_discover = true;
+            options.m_auto_resolve = true;
+            
+            return options;
+        }
+        
+        std::string m_regtype;
+        std::string m_domain;
+        bonjour_peer m_peer;
+        std::list<bonjour_service> m_peers;
+        std::shared_ptr<impl::change_signal> m_signal;
+        uint64_t m_generation;
+    };
+    
+    struct client
+    {
+        int m_socket;
+        std::string m_in;
+        std::string m_out;
+        std::shared_ptr<subscription> m_subscription;
+        std::unique_ptr<bonjour_register> m_register;
+        std::string m_registered_name;
+        bool m_register_failed;
+        bool m_failed;
+    };
+    
+    // Clients that fall this far behind (in bytes) are disconnected
+    
+    static constexpr size_t max_pending = 1 << 22;
+    
+public:
+    
+    bonjour_agent(const char *path, mode_t mode = 0600)
+    : m_path(path)
+    , m_mode(mode)
+    , m_socket(-1)
+    , m_wake{ -1, -1 }
+    , m_register_signal(std::make_shared<impl::change_signal>())
+    , m_running(false)
+    {}
+    
+    ~bonjour_agent()
+    {
+        stop();
+    }
+    
+    bonjour_agent(bonjour_agent const& rhs) = delete;
+    void operator = (bonjour_agent const& rhs) = delete;
+    
+    bool start()
+    {
+        if (m_thread.joinable())
+            return true;
+        
+        auto addr = impl::agent_protocol::address(m_path.c_str());
+        
+        m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        
+        if (m_socket < 0)
+            return false;
+        
+        unlink(m_path.c_str());
+        
+        // Peers signal changes (and stop() wakes the loop) by writing to the wake pipe
+        
+        if (bind(m_socket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ||
+            chmod(m_path.c_str(), m_mode) ||
+            listen(m_socket, 64) ||
+            pipe(m_wake))
+        {
+            close(m_socket);
+            unlink(m_path.c_str());
+            m_socket = -1;
+            m_wake[0] = m_wake[1] = -1;
+            return false;
+        }
+        
+        fcntl(m_socket, F_SETFL, O_NONBLOCK);
+        
+        for (int i = 0; i < 2; i++)
+        {
+            fcntl(m_wake[i], F_SETFL, fcntl(m_wake[i], F_GETFL) | O_NONBLOCK);
+            fcntl(m_wake[i], F_SETFD, FD_CLOEXEC);
+        }
+        
+        m_register_signal->wake(m_wake[1]);
+        m_running = true;
+        m_thread = std::thread(do_loop, this);
+        
+        return true;
+    }
+    
+    void stop()
+    {
+        if (m_thread.joinable())
+        {
+            char byte = 0;
+            
+            m_running = false;
+            
+            // A full pipe already wakes the loop, so a failed write can be ignored
+            
+            if (write(m_wake[1], &byte, 1) < 0)
+                byte = 0;
+            
+            m_thread.join();
+            
+            close(m_socket);
+            close(m_wake[0]);
+            close(m_wake[1]);
+            unlink(m_path.c_str());
+            m_socket = -1;
+            m_wake[0] = m_wake[1] = -1;
+        }
+    }
+    
+private:
+    
+    static void do_loop(bonjour_agent *agent)
+    {
+        agent->loop();
+    }
+    
+    void loop()
+    {
+        std::vector<pollfd> fds;
+        char buffer[64];
+        
+        while (m_running)
+        {
+            fds.clear();
+            fds.push_back({ m_socket, POLLIN, 0 });
+            fds.push_back({ m_wake[0], POLLIN, 0 });
+            
+            for (auto it = m_clients.begin(); it != m_clients.end(); it++)
+                fds.push_back({ it->m_socket, static_cast<short>(POLLIN | (it->m_out.empty() ? 0 : POLLOUT)), 0 });
+            
+            // Peers write to the wake pipe when they change, so there is no need to poll them
+            
+            poll(fds.data(), fds.size(), -1);
+            
+            if (fds[0].revents & POLLIN)
+                accept_clients();
+            
+            if (fds[1].revents & POLLIN)
+                while (read(m_wake[0], buffer, sizeof(buffer)) > 0);
+            
+            size_t idx = 2;
+            
+            for (auto it = m_clients.begin(); it != m_clients.end(); idx++, it++)
+            {
+                if (idx < fds.size() && fds[idx].revents && !service_client(*it))
+                    it->m_failed = true;
+            }
+            
+            update_subscriptions();
+            update_registrations();
+            
+            for (auto it = m_clients.begin(); it != m_clients.end(); )
+            {
+                auto jt = it++;
+                
+                if (jt->m_failed)
+                    remove_client(jt);
+            }
+        }
+        
+        while (!m_clients.empty())
+            remove_client(m_clients.begin());
+    }
+    
+    void accept_clients()
+    {
+        while (true)
+        {
+            int socket = accept(m_socket, nullptr, nullptr);
+            
+            if (socket < 0)
+                return;
+            
+            fcntl(socket, F_SETFL, O_NONBLOCK);
+            m_clients.push_back(client{ socket, std::string(), std::string(), nullptr, nullptr, std::string(), false, false });
+        }
+    }
+    
+    bool service_client(client& c)
+    {
+        using namespace impl::agent_protocol;
+        
+        if (!receive_all(c.m_socket, c.m_in))
+            return false;
+        
+        auto handler = [&](message type, reader& r)
+        {
+            if (type != message::subscribe || c.m_subscription)
+                return false;
+            
+            auto name = r.read_string();
+            auto regtype = r.read_string();
+            auto domain = impl::validate_domain(r.read_string().c_str());
+            auto port = r.read_u16();
+            
+            if (!r.valid())
+                return false;
+            
+            subscribe(c, domain, regtype);
+            
+            if (!name.empty())
+                start_register(c, name, regtype, domain, port);
+            
+            return true;
+        };
+        
+        return parse(c.m_in, handler) && flush(c);
+    }
+    
+    bool flush(client& c)
+    {
+        return impl::agent_protocol::send_all(c.m_socket, c.m_out) && c.m_out.size() <= max_pending;
+    }
+    
+    void subscribe(client& c, const std::string& domain, const std::string& regtype)
+    {
+        for (auto it = m_subscriptions.begin(); it != m_subscriptions.end(); it++)
+        {
+            if ((*it)->m_regtype == regtype && (*it)->m_domain == domain)
+                c.m_subscription = *it;
+        }
+        
+        if (!c.m_subscription)
+        {
+            c.m_subscription = std::make_shared<subscription>(regtype, domain, m_wake[1]);
+            m_subscriptions.push_back(c.m_subscription);
+        }
+        
+        // Send the current state to the new client
+        
+        auto& peers = c.m_subscription->m_peers;
+        
+        for (auto it = peers.begin(); it != peers.end(); it++)
+            write_add(c.m_out, *it);
+    }
+    
+    // Registrations wake the loop when they reply (their results are then sent by update_registrations())
+    
+    void start_register(client& c, const std::string& name, const std::string& regtype, const std::string& domain, uint16_t port)
+    {
+        c.m_register.reset(new bonjour_register(name.c_str(), regtype.c_str(), domain.c_str(), port));
+        c.m_register->observe(m_register_signal);
+        
+        if (!c.m_register->start())
+            write_failed(c);
+    }
+    
+    // Sends each registering client the name it was registered under (or a failure if the registration has stopped)
+    
+    void update_registrations()
+    {
+        for (auto it = m_clients.begin(); it != m_clients.end(); it++)
+        {
+            if (!it->m_register || it->m_register_failed)
+                continue;
+            
+            if (!it->m_register->active())
+                write_failed(*it);
+            else
+            {
+                auto name = it->m_register->registered_name();
+                
+                if (name.empty() || name == it->m_registered_name)
+                    continue;
+                
+                it->m_registered_name = name;
+                write_registered(it->m_out, name);
+            }
+            
+            if (!flush(*it))
+                it->m_failed = true;
+        }
+    }
+    
+    void remove_client(std::list<client>::iterator it)
+    {
+        close(it->m_socket);
+        m_clients.erase(it);
+        
+        // Subscriptions with no remaining clients are dropped
+        
+        for (auto jt = m_subscriptions.begin(); jt != m_subscriptions.end(); )
+        {
+            if (jt->use_count() == 1)
+                jt = m_subscriptions.erase(jt);
+            else
+                jt++;
+        }
+    }
+    
+    // Sends deltas between the last state sent and the current peers (for subscriptions whose peers have changed)
+    
+    void update_subscriptions()
+    {
+        std::list<bonjour_service> peers;
+        std::unordered_map<size_t, bonjour_service *> previous;
+        
+        for (auto it = m_subscriptions.begin(); it != m_subscriptions.end(); it++)
+        {
+            auto& sub = **it;
+            auto generation = sub.m_signal->generation();
+            std::string deltas;
+            
+            if (generation == sub.m_generation)
+                continue;
+            
+            sub.m_generation = generation;
+            sub.m_peer.list_peers(peers);
+            previous.clear();
+            
+            for (auto jt = sub.m_peers.begin(); jt != sub.m_peers.end(); jt++)
+                previous[jt->identity()] = &*jt;
+            
+            // Peers left in previous after this are those that have gone
+            
+            for (auto jt = peers.begin(); jt != peers.end(); jt++)
+            {
+                auto kt = previous.find(jt->identity());
+                
+                if (kt != previous.end() && kt->second->equal(*jt))
+                {
+                    auto& last = *kt->second;
+                    
+                    previous.erase(kt);
+                    
+                    if (last.host() == jt->host() && last.port() == jt->port() && last.address() == jt->address())
+                        continue;
+                }
+                
+                write_add(deltas, *jt);
+            }
+            
+            for (auto jt = previous.begin(); jt != previous.end(); jt++)
+                write_remove(deltas, *jt->second);
+            
+            if (deltas.empty())
+                continue;
+            
+            sub.m_peers = peers;
+            
+            for (auto jt = m_clients.begin(); jt != m_clients.end(); jt++)
+            {
+                if (jt->m_subscription.get() == &sub)
+                {
+                    jt->m_out += deltas;
+                    
+                    if (!flush(*jt))
+                        jt->m_failed = true;
+                }
+            }
+        }
+    }
+    
+    static void write_add(std::string& buffer, bonjour_service& service)
+    {
+        using namespace impl::agent_protocol;
+        
+        size_t start;
+        
+        begin(buffer, message::add, start);
+        write_string(buffer, service.name());
+        write_string(buffer, service.regtype());
+        write_string(buffer, service.domain());
+        write_string(buffer, service.fullname().c_str());
+        write_string(buffer, service.host().c_str());
+        write_string(buffer, service.address().c_str());
+        write_u16(buffer, service.port());
+        end(buffer, start);
+    }
+    
+    static void write_registered(std::string& buffer, const std::string& name)
+    {
+        using namespace impl::agent_protocol;
+        
+        size_t start;
+        
+        begin(buffer, message::registered, start);
+        write_string(buffer, name.c_str());
+        end(buffer, start);
+    }
+    
+    static void write_failed(client& c)
+    {
+        using namespace impl::agent_protocol;
+        
+        size_t start;
+        
+        c.m_register_failed = true;
+        begin(c.m_out, message::failed, start);
+        end(c.m_out, start);
+    }
+    
+    static void write_remove(std::string& buffer, bonjour_service& service)
+    {
+        using namespace impl::agent_protocol;
+        
+        size_t start;
+        
+        begin(buffer, message::remove, start);
+        write_string(buffer, service.name());
+        write_string(buffer, service.regtype());
+        write_string(buffer, service.domain());
+        end(buffer, start);
+    }
+    
+    std::string m_path;
+    mode_t m_mode;
+    int m_socket;
+    int m_wake[2];
+    
+    std::list<client> m_clients;
+    std::shared_ptr<impl::change_signal> m_register_signal;
+    std::list<std::shared_ptr<subscription>> m_subscriptions;
+    
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+};
+
+// A peer that receives its peers from a bonjour_agent (mirroring the interface of bonjour_peer)
+// Registration (unless in browse only mode) is also carried out by the agent for as long as the peer is connected
+// The peers are cleared if the connection to the agent is lost
+
+class bonjour_agent_peer
+{
+public:
+    
+    bonjour_agent_peer(const char *path,
+                       const char *name,
+                       const char *regtype,
+                       const char *domain,
+                       uint16_t port,
+                       bonjour_peer_options options = bonjour_peer_options())
+    : m_path(path)
+    , m_named(name, regtype, domain)
+    , m_port(port)
+    , m_options(options)
+    , m_socket(-1)
+    , m_register_failed(false)
+    , m_running(false)
+    {}
+    
+    ~bonjour_agent_peer()
+    {
+        stop();
+    }
+    
+    bonjour_agent_peer(bonjour_agent_peer const& rhs) = delete;
+    void operator = (bonjour_agent_peer const& rhs) = delete;
+    
+    bool start()
+    {
+        using namespace impl::agent_protocol;
+        
+        if (m_thread.joinable())
+            return true;
+        
+        auto addr = address(m_path.c_str());
+        
+        m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        
+        if (m_socket < 0)
+            return false;
+        
+        if (connect(m_socket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)))
+        {
+            close(m_socket);
+            m_socket = -1;
+            return false;
+        }
+        
+        bool advertise = m_options.m_mode != bonjour_peer_options::modes::browse_only;
+        
+        std::string buffer;
+        size_t start;
+        
+        begin(buffer, message::subscribe, start);
+        write_string(buffer, advertise ? name() : "");
+        write_string(buffer, regtype());
+        write_string(buffer, domain());
+        write_u16(buffer, m_port);
+        end(buffer, start);
+        
+        if (!send_all(m_socket, buffer) || !buffer.empty())
+        {
+            close(m_socket);
+            m_socket = -1;
+            return false;
+        }
+        
+        fcntl(m_socket, F_SETFL, O_NONBLOCK);
+        
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_registered_name.clear();
+            m_register_failed = false;
+        }
+        
+        m_running = true;
+        m_thread = std::thread(do_loop, this);
+        
+        return true;
+    }
+    
+    void stop()
+    {
+        if (m_thread.joinable())
+        {
+            m_running = false;
+            m_thread.join();
+            close(m_socket);
+            m_socket = -1;
+        }
+    }
+    
+    void clear()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_peers.clear();
+        m_signal.notify();
+    }
+    
+    bool active() const
+    {
+        return m_running;
+    }
+    
+    const char *name() const
+    {
+        return m_named.name();
+    }
+    
+    const char *regtype() const
+    {
+        return m_named.regtype();
+    }
+    
+    const char *domain() const
+    {
+        return m_named.domain();
+    }
+    
+    uint16_t port() const
+    {
+        return m_port;
+    }
+    
+    // The name the agent registered this peer under (empty until registration completes)
+    
+    std::string registered_name() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_registered_name;
+    }
+    
+    // True if the agent could not register this peer (or the registration has since stopped)
+    
+    bool registration_failed() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_register_failed;
+    }
+    
+    void list_peers(std::list<bonjour_service> &peers)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        peers = m_peers;
+    }
+    
+    // The generation increments whenever the peers change
+    
+    uint64_t generation() const
+    {
+        return m_signal.generation();
+    }
+    
+    // Blocking waits (these return false if the deadline passes first)
+    
+    bool wait_for_change(uint64_t generation, bonjour_clock::time_point deadline)
+    {
+        return m_signal.wait_for_change(generation, deadline);
+    }
+    
+    bool wait_for_peers(size_t count, bonjour_clock::time_point deadline)
+    {
+        while (true)
+        {
+            auto generation = m_signal.generation();
+            
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                
+                if (m_peers.size() >= count)
+                    return true;
+            }
+            
+            if (!m_signal.wait_for_change(generation, deadline))
+                return false;
+        }
+    }
+    
+private:
+    
+    static void do_loop(bonjour_agent_peer *peer)
+    {
+        peer->loop();
+    }
+    
+    void loop()
+    {
+        using namespace impl::agent_protocol;
+        
+        std::string buffer;
+        
+        auto handler = [&](message type, reader& r)
+        {
+            if (type == message::registered || type == message::failed)
+                return registration(type, r);
+            
+            auto name = r.read_string();
+            auto regtype = r.read_string();
+            auto domain = r.read_string();
+            
+            bonjour_named named(name.c_str(), regtype.c_str(), domain.c_str());
+            
+            if (type == message::add)
+            {
+                auto fullname = r.read_string();
+                auto host = r.read_string();
+                auto address = r.read_string();
+                auto port = r.read_u16();
+                
+                if (!r.valid())
+                    return false;
+                
+                bonjour_service service(named, fullname.c_str(), host.c_str(), port, address.c_str());
+                
+                std::unique_lock<std::mutex> lock(m_mutex);
+                
+                if (!m_options.m_self_discover && named.equal(self()))
+                    return true;
+                
+                auto it = named.find(m_peers);
+                
+                if (it != m_peers.end())
+                    *it = service;
+                else
+                    m_peers.push_back(service);
+            }
+            else if (type == message::remove && r.valid())
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                
+                auto it = named.find(m_peers);
+                
+                if (it != m_peers.end())
+                    m_peers.erase(it);
+            }
+            else
+                return false;
+            
+            m_signal.notify();
+            return true;
+        };
+        
+        impl::socket_waiter waiter(m_socket);
+        
+        while (m_running)
+        {
+            auto rc = waiter.wait(100);
+            
+            if (rc < 0 || (rc > 0 && (!receive_all(m_socket, buffer) || !parse(buffer, handler))))
+                break;
+        }
+        
+        m_running = false;
+        
+        // Without the agent the peers can no longer be kept up to date
+        
+        clear();
+    }
+    
+    bool registration(impl::agent_protocol::message type, impl::agent_protocol::reader& r)
+    {
+        std::string name;
+        
+        if (type == impl::agent_protocol::message::registered)
+            name = r.read_string();
+        
+        if (!r.valid())
+            return false;
+        
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            
+            if (type == impl::agent_protocol::message::failed)
+            {
+                m_register_failed = true;
+                return true;
+            }
+            
+            m_registered_name = name;
+            
+            // This peer may have been discovered under its new name before the name was known
+            
+            auto it = self().find(m_peers);
+            
+            if (m_options.m_self_discover || it == m_peers.end())
+                return true;
+            
+            m_peers.erase(it);
+        }
+        
+        m_signal.notify();
+        return true;
+    }
+    
+    // This peer as registered by the agent (the daemon may have renamed it after a conflict)
+    // N.B. This should be called with the lock held
+    
+    bonjour_named self() const
+    {
+        const char *name = m_registered_name.empty() ? m_named.name() : m_registered_name.c_str();
+        
+        return bonjour_named(name, m_named.regtype(), m_named.domain());
+    }
+    
+    std::string m_path;
+    bonjour_named m_named;
+    uint16_t m_port;
+    bonjour_peer_options m_options;
+    
+    int m_socket;
+    
+    // N.B. This object has its own thread, so it always locks (whatever the policy)
+    
+    mutable std::mutex m_mutex;
+    std::list<bonjour_service> m_peers;
+    std::string m_registered_name;
+    bool m_register_failed;
+    impl::basic_change_signal<> m_signal;
+    
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+};
+
+#endif /* BONJOUR_AGENT_HPP */
@@ -4,13 +4,46 @@
 
 #include <dns_sd.h>
 
+#include "bonjour_executor.hpp"
+#include "bonjour_lock_stats.hpp"
+#include "bonjour_policy.hpp"
+#include "bonjour_watchdog.hpp"
 #include "utils.hpp"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <cstdint>
+#include <list>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <type_traits>
+
+// The policy is chosen for the whole build (define BONJOUR_FOR_CPP_POLICY before including this header)
+// Custom policies may be declared after including bonjour_policy.hpp (and may supply any container with push_back and erase)
+// N.B. Every translation unit of a program must use the same policy (the classes are defined differently for each)
+
+#ifndef BONJOUR_FOR_CPP_POLICY
+#define BONJOUR_FOR_CPP_POLICY bonjour_threaded_policy
+#endif
+
+using bonjour_policy = BONJOUR_FOR_CPP_POLICY;
+
+namespace impl
+{
+    using change_signal = basic_change_signal<bonjour_policy::internal_mutex_type, bonjour_policy::condition_type>;
+}
+
+// The clock used for deadlines and timing
+
+using bonjour_clock = std::chrono::steady_clock;
 
 template <class T>
 struct bonjour_notify
@@ -18,6 +51,11 @@ struct bonjour_notify
     using stop_type = void(*)(T *);
     using state_type = void(*)(T *, const char *, const char *, const char *, bool);
     using resolve_type = void(*)(T *, const char *, const char *, uint16_t, bool);
+    using address_type = void(*)(T *, const char *, const char *, bool);
+    
+    // The final argument is true for an add and false for a remove
+    
+    using watch_type = void(*)(T *, const char *, const char *, const char *, bool);
 };
 
 // A base object to store information about bonjour services and to interact with the API
@@ -26,20 +64,82 @@ class bonjour_base
 {
 protected:
     
-    using mutex_type = std::recursive_mutex;
+    using mutex_type = impl::profiled<bonjour_policy::mutex_type>;
     using mutex_lock = std::lock_guard<mutex_type>;
     
 private:
     
-    // A self-deleting thread for processing bonjour replies
+    static std::atomic<int>& drain_budget()
+    {
+        static std::atomic<int> budget(64);
+        return budget;
+    }
+    
+    class bonjour_thread;
+    
+    // A process-wide registry of running threads (so that they can all be stopped together)
+    // Writing to the wakeup pipe ends the waits of every thread early
+    
+    struct thread_registry
+    {
+        thread_registry()
+        {
+            if (pipe(m_wake))
+                m_wake[0] = m_wake[1] = -1;
+            
+            for (int i = 0; i < 2 && m_wake[i] >= 0; i++)
+            {
+                fcntl(m_wake[i], F_SETFL, fcntl(m_wake[i], F_GETFL) | O_NONBLOCK);
+                fcntl(m_wake[i], F_SETFD, FD_CLOEXEC);
+            }
+        }
+        
+        bonjour_policy::internal_mutex_type m_mutex;
+        bonjour_policy::condition_type m_cond;
+        std::list<bonjour_thread *> m_threads;
+        int m_shutdowns = 0;
+        int m_wake[2];
+    };
+    
+    using registry_lock = std::unique_lock<bonjour_policy::internal_mutex_type>;
+    
+    // N.B. This is never destroyed as detached threads may still be finishing at exit
+    
+    static thread_registry& threads()
+    {
+        static thread_registry *registry = new thread_registry;
+        return *registry;
+    }
+    
+    // A thread for processing bonjour replies (which owns itself until it has finished)
     
     class bonjour_thread
     {
     public:
         
-        static bonjour_thread *start_service(DNSServiceRef sd_ref)
+        static std::shared_ptr<bonjour_thread> start_service(DNSServiceRef sd_ref)
         {
-            return new bonjour_thread(sd_ref);
+            std::shared_ptr<bonjour_thread> thread(new bonjour_thread(sd_ref));
+            
+            {
+                auto& registry = threads();
+                registry_lock lock(registry.m_mutex);
+                thread->m_entry = registry.m_threads.insert(registry.m_threads.end(), thread.get());
+                
+                // The wakeup pipe stays readable during a shutdown, so threads started then don't wait on it
+                
+                thread->m_wake = registry.m_shutdowns ? -1 : registry.m_wake[0];
+            }
+            
+            thread->m_thread = std::thread(do_loop, thread);
+            
+            return thread;
+        }
+        
+        ~bonjour_thread()
+        {
+            if (m_thread.joinable())
+                m_thread.detach();
         }
         
         void stop()
@@ -48,22 +148,42 @@ private:
             m_invalid = true;
         }
         
+        // Updates a record of the operation (the lock makes sure this cannot overlap with processing)
+        
+        DNSServiceErrorType update_record(DNSRecordRef record, const void *data, uint16_t length, uint32_t ttl)
+        {
+            mutex_lock lock(m_mutex);
+            
+            if (m_invalid)
+                return kDNSServiceErr_BadState;
+            
+            return DNSServiceUpdateRecord(m_sd_ref, record, 0, length, data, ttl);
+        }
+        
+        // Marks the thread as stopped without waiting for any processing to finish (used for shutdown)
+        
+        void invalidate()
+        {
+            m_invalid = true;
+        }
+        
+        bool valid() const
+        {
+            return !m_invalid;
+        }
+    
     private:
-                
+        
         bonjour_thread(DNSServiceRef sd_ref)
         : m_sd_ref(sd_ref)
         , m_invalid(false)
         , m_error(false)
-        , m_thread(do_loop, this)
-        {}
-        
-        ~bonjour_thread()
+        , m_wake(-1)
         {
-            if (m_thread.joinable())
-                m_thread.detach();
+            impl::set_lock_class(m_mutex, "bonjour_thread");
         }
         
-        static void do_loop(bonjour_thread *thread)
+        static void do_loop(std::shared_ptr<bonjour_thread> thread)
         {
             thread->loop();
         }
@@ -71,50 +191,162 @@ private:
         void loop()
         {
             bool exit = false;
-        
+            
             // Socket
             
-            auto socket = DNSServiceRefSockFD(m_sd_ref);
+            impl::socket_waiter waiter(DNSServiceRefSockFD(m_sd_ref), m_wake);
+            
+            impl::in_callback() = true;
             
             while (!exit)
             {
-                auto rc = impl::wait_on_socket(socket, 1, 0);
+                auto rc = waiter.wait(1000);
                 
-                mutex_lock lock(m_mutex);
+                {
+                    mutex_lock lock(m_mutex);
+                    
+                    if (!m_invalid)
+                    {
+                        if (rc < 0)
+                            m_error = true;
+                        else if (rc > 0)
+                            process(waiter);
+                    }
+                    
+                    exit = m_invalid;
+                }
                 
-                if (m_invalid)
-                    exit = true;
-                else if (rc < 0 || (rc > 0 && DNSServiceProcessResult(m_sd_ref) != kDNSServiceErr_NoError))
-                    m_error = true;
+                // N.B. This may destroy the object that owns this thread, so no locks can be held
+                
+                impl::run_deferred();
             }
             
             DNSServiceRefDeallocate(m_sd_ref);
-            delete this;
+            
+            auto& registry = threads();
+            
+            {
+                registry_lock lock(registry.m_mutex);
+                registry.m_threads.erase(m_entry);
+            }
+            
+            registry.m_cond.notify_all();
+        }
+        
+        // Process replies whilst more are pending (up to the drain budget) before waiting again
+        
+        void process(impl::socket_waiter& waiter)
+        {
+            const int budget = drain_budget();
+            
+            for (int i = 0; i < budget && !m_invalid; i++)
+            {
+                impl::more_coming() = false;
+                
+                if (DNSServiceProcessResult(m_sd_ref) != kDNSServiceErr_NoError)
+                {
+                    m_error = true;
+                    return;
+                }
+                
+                if (!impl::more_coming() && waiter.wait(0) <= 0)
+                    return;
+            }
         }
-               
+        
         DNSServiceRef m_sd_ref;
-        bool m_invalid;
+        std::atomic<bool> m_invalid;
         bool m_error;
+        int m_wake;
         mutex_type m_mutex;
         std::thread m_thread;
+        std::list<bonjour_thread *>::iterator m_entry;
     };
     
 public:
-  
+    
+    // The maximum number of replies processed per wakeup of a thread
+    
+    static void set_drain_budget(int budget)
+    {
+        drain_budget() = budget < 1 ? 1 : budget;
+    }
+    
+    // Stops every running operation in parallel (returning true if all have finished before the deadline)
+    // Once finished every connection to the daemon has been closed, which is when registrations are withdrawn
+    // N.B. Objects may still be stopped or destroyed safely afterwards (but this should not be called from a notification)
+    
+    static bool shutdown(bonjour_clock::time_point deadline)
+    {
+        auto& registry = threads();
+        registry_lock lock(registry.m_mutex);
+        
+        registry.m_shutdowns++;
+        
+        // N.B. Threads are invalidated without taking their locks as replies may be waiting on the registry
+        
+        for (auto it = registry.m_threads.begin(); it != registry.m_threads.end(); it++)
+            (*it)->invalidate();
+        
+        char byte = 0;
+        
+        bool complete = registry.m_wake[1] < 0 || write(registry.m_wake[1], &byte, 1) == 1;
+        
+        complete = complete && registry.m_cond.wait_until(lock, deadline, [&](){ return registry.m_threads.empty(); });
+        
+        // Empty the wakeup pipe so that later operations wait normally (threads still finishing exit on their timeout)
+        
+        if (!--registry.m_shutdowns)
+            while (read(registry.m_wake[0], &byte, 1) > 0);
+        
+        return complete;
+    }
+    
+    // The number of operations with a running thread
+    
+    static size_t running()
+    {
+        auto& registry = threads();
+        registry_lock lock(registry.m_mutex);
+        return registry.m_threads.size();
+    }
+    
     bonjour_base(const char *regtype, const char *domain)
     : m_regtype(impl::validate_regtype(regtype))
     , m_domain(impl::validate_domain(domain))
+    , m_static_regtype(nullptr)
     , m_thread(nullptr)
+    , m_sd_ref(nullptr)
+    , m_stale_ref(nullptr)
+    , m_processing(false)
+    , m_last_error(kDNSServiceErr_NoError)
+    {}
+    
+    bonjour_base(impl::static_regtype regtype, const char *domain)
+    : m_domain(impl::validate_domain(domain))
+    , m_static_regtype(regtype.m_regtype)
+    , m_thread(nullptr)
+    , m_sd_ref(nullptr)
+    , m_stale_ref(nullptr)
+    , m_processing(false)
+    , m_last_error(kDNSServiceErr_NoError)
     {}
     
     ~bonjour_base()
     {
         stop();
+        end_notifications();
     }
     
     bonjour_base(bonjour_base const& rhs)
-    : m_thread(nullptr)
+    : m_static_regtype(nullptr)
+    , m_thread(nullptr)
+    , m_sd_ref(nullptr)
+    , m_stale_ref(nullptr)
+    , m_processing(false)
+    , m_last_error(kDNSServiceErr_NoError)
     {
+        impl::set_lock_class(m_mutex, impl::lock_class(rhs.m_mutex));
         *this = rhs;
     }
     
@@ -122,29 +354,107 @@ public:
     {
         m_regtype = rhs.m_regtype;
         m_domain = rhs.m_domain;
+        m_static_regtype = rhs.m_static_regtype;
     }
     
     void stop()
     {
-        if (active())
+        if constexpr (!bonjour_policy::threaded)
+        {
+            // N.B. If called from a reply the reference is released once processing is done
+            
+            if (m_sd_ref && m_processing)
+                m_stale_ref = m_sd_ref;
+            else if (m_sd_ref)
+                DNSServiceRefDeallocate(m_sd_ref);
+            
+            m_sd_ref = nullptr;
+        }
+        else if (auto thread = current_thread())
         {
             // N.B. Don't hold the lock whilst stopping the thread as that can cause deadlocks
             
-            m_thread->stop();
+            thread->stop();
             mutex_lock lock(m_mutex);
             m_thread = nullptr;
         }
+        
+        // Queued notifications refer to this object, so wait for them (unless called from a reply or notification)
+        // N.B. Destructors then call end_notifications() to drop any that are still queued
+        
+        if (m_strand && !impl::in_callback())
+            m_strand->wait();
     }
     
     bool active() const
     {
         mutex_lock lock(m_mutex);
-        return m_thread;
+        
+        if constexpr (!bonjour_policy::threaded)
+            return m_sd_ref;
+        
+        // N.B. A thread invalidated by shutdown() is no longer active (so the object can be started again)
+        
+        return m_thread != nullptr && m_thread->valid();
+    }
+    
+    // Without threads the socket should be added to the user's event loop (it is -1 when inactive)
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    int socket() const
+    {
+        return m_sd_ref ? DNSServiceRefSockFD(m_sd_ref) : -1;
+    }
+    
+    // Processes replies when the socket is readable (returning false if the object is no longer active)
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    bool process()
+    {
+        DNSServiceRef sd_ref = m_sd_ref;
+        
+        if (!sd_ref || m_processing)
+            return sd_ref;
+        
+        bool error = false;
+        bool in = impl::in_callback();
+        
+        m_processing = true;
+        impl::in_callback() = true;
+        
+        for (int i = 0; i < drain_budget() && m_sd_ref == sd_ref; i++)
+        {
+            impl::more_coming() = false;
+            
+            if ((error = DNSServiceProcessResult(sd_ref) != kDNSServiceErr_NoError) || !impl::more_coming())
+                break;
+        }
+        
+        m_processing = false;
+        impl::in_callback() = in;
+        
+        if (m_stale_ref)
+        {
+            DNSServiceRefDeallocate(m_stale_ref);
+            m_stale_ref = nullptr;
+        }
+        
+        if (error && m_sd_ref == sd_ref)
+            stop();
+        
+        // N.B. Deferred work may destroy this object (so it waits for the outermost call if called from a reply)
+        
+        bool still_active = active();
+        
+        if (!in)
+            impl::run_deferred();
+        
+        return still_active;
     }
     
     const char *regtype() const
     {
-        return m_regtype.c_str();
+        return m_static_regtype ? m_static_regtype : m_regtype.c_str();
     }
     
     const char *domain() const
@@ -152,28 +462,121 @@ public:
         return m_domain.c_str();
     }
     
+    // The error from the last start or reply (kDNSServiceErr_NoError if there has been none)
+    
+    DNSServiceErrorType error() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_last_error;
+    }
+    
+    // An optional signal that is notified after every reply (allowing other threads to wait on this object)
+    
+    void observe(std::shared_ptr<impl::change_signal> signal)
+    {
+        mutex_lock lock(m_mutex);
+        m_observer = signal;
+    }
+    
 protected:
     
-    template <typename T, typename ...Args>
-    static void notify(T func, Args...args)
+    // With an executor notifications are posted to the strand of the object (with any strings copied)
+    
+    template <typename F, typename T, typename ...Args>
+    static void notify(bonjour_callback callback, F func, T *object, Args...args)
+    {
+        if (!func)
+            return;
+        
+        if (auto strand = static_cast<bonjour_base *>(object)->m_strand)
+        {
+            auto held = std::make_tuple(impl::hold(args)...);
+            auto lifetime = static_cast<bonjour_base *>(object)->notification_lifetime();
+            
+            strand->post([callback, func, object, held, lifetime]()
+            {
+                std::lock_guard<std::mutex> lock(lifetime->m_mutex);
+                
+                if (!lifetime->m_alive)
+                    return;
+                
+                std::apply([&](const auto& ...values){ timed(callback, func, object, impl::pass(values)...); }, held);
+            });
+        }
+        else
+            timed(callback, func, object, args...);
+    }
+    
+    // Callbacks are only timed when the watchdog is enabled
+    
+    template <typename F, typename T, typename ...Args>
+    static void timed(bonjour_callback callback, F func, T *object, Args...args)
     {
-        if (func)
-            func(args...);
+        if (!bonjour_watchdog::enabled())
+        {
+            func(object, args...);
+            return;
+        }
+        
+        auto start = bonjour_clock::now();
+        func(object, args...);
+        bonjour_watchdog::check(callback, object, bonjour_clock::now() - start);
+    }
+    
+    // N.B. This should only be called whilst the object is not active
+    
+    void set_executor(bonjour_executor executor)
+    {
+        m_strand = executor ? std::make_shared<impl::strand>(executor) : nullptr;
+        m_lifetime = executor ? std::make_shared<impl::lifetime>() : nullptr;
+    }
+    
+    std::shared_ptr<impl::lifetime> notification_lifetime() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_lifetime;
+    }
+    
+    // Destructors call this after stopping, so that no notification runs on (or is still running on) a dead object
+    // Queued notifications are dropped and one running on another thread is waited for
+    // N.B. A notification of this object that destroys it already holds the lock (and nothing else of the strand can run)
+    
+    void end_notifications()
+    {
+        auto lifetime = notification_lifetime();
+        
+        if (!lifetime)
+            return;
+        
+        if (m_strand->running_here())
+            lifetime->m_alive = false;
+        else
+            lifetime->end();
     }
     
     template <typename T, typename ...Args>
     bool spawn(T *object, Args ...args)
+    {
+        return spawn_flags(0, object, args...);
+    }
+    
+    template <typename T, typename ...Args>
+    bool spawn_flags(DNSServiceFlags flags, T *object, Args ...args)
     {
         mutex_lock lock(m_mutex);
-
+        
         // If the service is not active then attempt to spawn a thread for callbacks
         
         if (!active())
         {
             DNSServiceRef sd_ref = nullptr;
-            auto err = T::service(&sd_ref, 0, 0, args..., T::callback_type::reply, object);
-
-            if (err == kDNSServiceErr_NoError)
+            auto err = T::service(&sd_ref, flags, 0, args..., T::callback_type::reply, object);
+            
+            m_last_error = err;
+            
+            if (err == kDNSServiceErr_NoError && !bonjour_policy::threaded)
+                m_sd_ref = sd_ref;
+            else if (err == kDNSServiceErr_NoError)
                 m_thread = bonjour_thread::start_service(sd_ref);
             else
                 stop();
@@ -186,7 +589,57 @@ protected:
     void stop_notify(T func, Args...args)
     {
         stop();
-        notify(func, args...);
+        notify(bonjour_callback::stop, func, args...);
+    }
+    
+    // Updates a record of the operation (a null record is the primary TXT record of a registration)
+    // N.B. Don't call this whilst holding the lock of the object as that can cause deadlocks
+    
+    DNSServiceErrorType update_record(DNSRecordRef record, const void *data, uint16_t length, uint32_t ttl = 0)
+    {
+        std::shared_ptr<bonjour_thread> thread;
+        
+        {
+            mutex_lock lock(m_mutex);
+            
+            if constexpr (!bonjour_policy::threaded)
+                return m_sd_ref ? DNSServiceUpdateRecord(m_sd_ref, record, 0, length, data, ttl) : kDNSServiceErr_BadState;
+            
+            thread = m_thread;
+        }
+        
+        return thread ? thread->update_record(record, data, length, ttl) : kDNSServiceErr_BadState;
+    }
+    
+    std::shared_ptr<bonjour_thread> current_thread() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_thread;
+    }
+    
+    void set_error(DNSServiceErrorType error)
+    {
+        mutex_lock lock(m_mutex);
+        m_last_error = error;
+    }
+    
+    std::shared_ptr<impl::change_signal> observer() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_observer;
+    }
+    
+    void notify_observer()
+    {
+        std::shared_ptr<impl::change_signal> observer;
+        
+        {
+            mutex_lock lock(m_mutex);
+            observer = m_observer;
+        }
+        
+        if (observer)
+            observer->notify();
     }
     
     // Automatic callback handling
@@ -197,21 +650,49 @@ protected:
     template<typename R, typename... Args, class T, size_t ErrIdx, size_t ...Idxs>
     struct callback_type<R(*)(Args...), T, ErrIdx, Idxs...>
     {
+        // The flags are the first parameter of their type (they always precede the interface index)
+        
+        static constexpr size_t flags_index()
+        {
+            constexpr bool is_flags[] = { std::is_same<Args, DNSServiceFlags>::value... };
+            
+            for (size_t i = 0; i < sizeof...(Args); i++)
+                if (is_flags[i])
+                    return i;
+            
+            return 0;
+        }
+        
         static void reply(Args... args)
         {
             constexpr size_t context_idx = std::tuple_size<std::tuple<Args...>>::value - 1;
+            constexpr size_t flags_idx = flags_index();
             
             std::tuple parameters(args...);
             
             T *obj = reinterpret_cast<T *>(std::get<context_idx>(parameters));
             
+            // Let the thread know whether further replies are already queued
+            
+            impl::more_coming() = (std::get<flags_idx>(parameters) & kDNSServiceFlagsMoreComing) != 0;
+            
+            // N.B. The observer is taken first as the object may be deleted by its stop callback
+            
+            auto observer = obj->observer();
+            
             if (std::get<ErrIdx>(parameters) == kDNSServiceErr_NoError)
             {
                 mutex_lock lock(obj->m_mutex);
                 obj->reply({std::get<Idxs>(parameters)}...);
             }
             else
+            {
+                obj->set_error(std::get<ErrIdx>(parameters));
                 obj->stop_notify(obj->m_notify.m_stop, obj);
+            }
+            
+            if (observer)
+                observer->notify();
         }
     };
     
@@ -224,8 +705,21 @@ private:
     
     std::string m_regtype;
     std::string m_domain;
+    const char *m_static_regtype;
+    
+    std::shared_ptr<bonjour_thread> m_thread;
+    
+    // Used instead of a thread with a single-threaded policy
+    
+    DNSServiceRef m_sd_ref;
+    DNSServiceRef m_stale_ref;
+    bool m_processing;
+    
+    DNSServiceErrorType m_last_error;
     
-    bonjour_thread *m_thread;
+    std::shared_ptr<impl::change_signal> m_observer;
+    std::shared_ptr<impl::strand> m_strand;
+    std::shared_ptr<impl::lifetime> m_lifetime;
 };
 
 #endif /* BONJOUR_BASE_HPP */
@@ -3,12 +3,32 @@
 #define BONJOUR_BROWSE_HPP
 
 #include "bonjour_base.hpp"
+#include "bonjour_damping.hpp"
 #include "bonjour_named.hpp"
+#include "bonjour_timer.hpp"
 
+#include <algorithm>
 #include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Options for bonjour_browse
+
+struct bonjour_browse_options
+{
+    bonjour_damping_options m_damping;
+    
+    // Shared browses with the same regtype and domain use a single underlying browse and service list
+    
+    bool m_shared = false;
+};
 
 // An object for browsing bonjour services
 // Makes a list of named services available, but does not resolve them
+// Notifications report every add and remove, but the service list is subject to any flap damping
+// Shared browses each receive their own notifications and keep their own damping state
+// Watches report the adds and removes of a single named service (found with one hash lookup per event)
 
 class bonjour_browse : public bonjour_base
 {
@@ -28,12 +48,62 @@ public:
         bonjour_notify<bonjour_browse>::stop_type m_stop;
         bonjour_notify<bonjour_browse>::state_type m_add;
         bonjour_notify<bonjour_browse>::state_type m_remove;
+        
+        bonjour_executor m_executor;
     };
     
-    bonjour_browse(const char *regtype, const char *domain, notify_type notify = notify_type())
+    using watch_id = uint64_t;
+    
+    bonjour_browse(const char *regtype,
+                   const char *domain,
+                   notify_type notify = notify_type(),
+                   bonjour_browse_options options = bonjour_browse_options())
+    : bonjour_base(regtype, domain)
+    , m_damping(options.m_damping)
+    , m_expiry_timer(0)
+    , m_closing(false)
+    , m_shared(options.m_shared)
+    , m_last_watch(0)
+    , m_notify(notify)
+    {
+        impl::set_lock_class(m_mutex, "bonjour_browse");
+        set_executor(notify.m_executor);
+    }
+    
+    bonjour_browse(impl::static_regtype regtype,
+                   const char *domain,
+                   notify_type notify = notify_type(),
+                   bonjour_browse_options options = bonjour_browse_options())
     : bonjour_base(regtype, domain)
+    , m_damping(options.m_damping)
+    , m_expiry_timer(0)
+    , m_closing(false)
+    , m_shared(options.m_shared)
+    , m_last_watch(0)
     , m_notify(notify)
-    {}
+    {
+        impl::set_lock_class(m_mutex, "bonjour_browse");
+        set_executor(notify.m_executor);
+    }
+    
+    ~bonjour_browse()
+    {
+        bonjour_timers::timer_id timer;
+        
+        {
+            mutex_lock lock(m_mutex);
+            m_closing = true;
+            timer = m_expiry_timer;
+        }
+        
+        // N.B. Don't hold the lock whilst cancelling as the timer may be waiting on it
+        
+        if (timer)
+            bonjour_timers::shared().cancel(timer);
+        
+        stop();
+        end_notifications();
+    }
     
     bonjour_browse(bonjour_browse const& rhs) = delete;
     bonjour_browse(bonjour_browse const&& rhs) = delete;
@@ -43,48 +113,404 @@ public:
     bool start()
     {
         clear();
+        
+        if (m_shared)
+            return subscribe();
+        
         return spawn(this, regtype(), domain());
     }
     
+    void stop()
+    {
+        unsubscribe();
+        bonjour_base::stop();
+    }
+    
+    bool active() const
+    {
+        if (auto core = shared_core())
+            return core->active();
+        
+        return bonjour_base::active();
+    }
+    
+    // Without threads a shared browse uses the socket (and processing) of the underlying browse
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    int socket() const
+    {
+        if (auto core = shared_core())
+            return core->socket<P>();
+        
+        return bonjour_base::socket<P>();
+    }
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    bool process()
+    {
+        if (auto core = shared_core())
+            return core->process<P>();
+        
+        return bonjour_base::process<P>();
+    }
+    
+    // N.B. For shared browses the service list belongs to all subscribers, so only damping state is cleared
+    
     void clear()
     {
         mutex_lock lock(m_mutex);
         m_services.clear();
+        m_damping.clear();
+        m_signal.notify();
     }
     
     void list_services(std::list<bonjour_named> &services)
+    {
+        // N.B. Don't hold the lock whilst listing the shared services as that can cause deadlocks
+        
+        if (auto core = shared_core())
+            core->list_services(services);
+        else
+        {
+            mutex_lock lock(m_mutex);
+            services.assign(m_services.begin(), m_services.end());
+        }
+        
+        mutex_lock lock(m_mutex);
+        
+        if (m_damping.enabled())
+            m_damping.filter(services);
+    }
+    
+    // Watches a named service (if the service is already present the callback is called immediately)
+    // Watches persist across restarts and a watch removed during a notification may still see that event
+    
+    watch_id watch(const bonjour_named& named, bonjour_notify<bonjour_browse>::watch_type callback)
+    {
+        // N.B. Lock the owner of the service list first (as when subscribing)
+        
+        auto core = shared_core();
+        auto& owner = core ? *core : *this;
+        
+        mutex_lock owner_lock(owner.m_mutex);
+        mutex_lock lock(m_mutex);
+        
+        watch_id id = ++m_last_watch;
+        m_watches.emplace(named.identity(), watch_entry{ id, named, callback });
+        
+        if (named.find(owner.m_services) != owner.m_services.end())
+            notify(bonjour_callback::watch, callback, this, named.name(), named.regtype(), named.domain(), true);
+        
+        return id;
+    }
+    
+    bool unwatch(watch_id id)
+    {
+        mutex_lock lock(m_mutex);
+        
+        for (auto it = m_watches.begin(); it != m_watches.end(); it++)
+        {
+            if (it->second.m_id == id)
+            {
+                m_watches.erase(it);
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    size_t watches() const
     {
         mutex_lock lock(m_mutex);
-        services = m_services;
+        return m_watches.size();
+    }
+    
+    // The generation increments whenever the list of services changes
+    
+    uint64_t generation() const
+    {
+        return m_signal.generation();
+    }
+    
+    // Blocking waits (these return false if the deadline passes first)
+    
+    bool wait_for_change(uint64_t generation, bonjour_clock::time_point deadline)
+    {
+        return m_signal.wait_for_change(generation, deadline);
+    }
+    
+    bool wait_for_services(size_t count, bonjour_clock::time_point deadline)
+    {
+        std::list<bonjour_named> services;
+        
+        while (true)
+        {
+            auto generation = m_signal.generation();
+            
+            list_services(services);
+            
+            if (services.size() >= count)
+                return true;
+            
+            if (!m_signal.wait_for_change(generation, deadline))
+                return false;
+        }
     }
     
 private:
     
+    struct watch_entry
+    {
+        watch_id m_id;
+        bonjour_named m_named;
+        bonjour_notify<bonjour_browse>::watch_type m_callback;
+    };
+    
+    // A process-wide registry of the browses underlying shared browses
+    
+    struct shared_registry
+    {
+        bonjour_policy::internal_mutex_type m_mutex;
+        std::list<std::weak_ptr<bonjour_browse>> m_cores;
+    };
+    
+    // N.B. This is never destroyed as detached threads may still be finishing at exit
+    
+    static shared_registry& registry()
+    {
+        static shared_registry *registry = new shared_registry;
+        return *registry;
+    }
+    
+    std::shared_ptr<bonjour_browse> shared_core() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_core;
+    }
+    
+    bool subscribe()
+    {
+        std::shared_ptr<bonjour_browse> core;
+        
+        if (shared_core())
+            return active();
+        
+        {
+            auto& shared = registry();
+            std::lock_guard<bonjour_policy::internal_mutex_type> lock(shared.m_mutex);
+            
+            for (auto it = shared.m_cores.begin(); it != shared.m_cores.end() && !core; )
+            {
+                auto jt = it++;
+                
+                if (auto candidate = jt->lock())
+                {
+                    if (!strcmp(candidate->regtype(), regtype()) && !strcmp(candidate->domain(), domain()))
+                        core = candidate;
+                }
+                else
+                    shared.m_cores.erase(jt);
+            }
+            
+            if (!core)
+            {
+                core = std::make_shared<bonjour_browse>(regtype(), domain());
+                core->m_self = core;
+                shared.m_cores.push_back(core);
+            }
+        }
+        
+        // Add this subscriber and replay the services already known
+        
+        {
+            mutex_lock lock(core->m_mutex);
+            
+            if (!core->active())
+                core->restart_core();
+            
+            core->m_subscribers.push_back(this);
+            
+            for (auto it = core->m_services.begin(); it != core->m_services.end(); it++)
+                deliver(kDNSServiceFlagsAdd, *it, true);
+        }
+        
+        {
+            mutex_lock lock(m_mutex);
+            m_core = core;
+        }
+        
+        return core->active();
+    }
+    
+    void unsubscribe()
+    {
+        std::shared_ptr<bonjour_browse> core;
+        
+        {
+            mutex_lock lock(m_mutex);
+            std::swap(core, m_core);
+        }
+        
+        // After this no more notifications will arrive (the core is released without any lock held)
+        
+        if (core)
+        {
+            mutex_lock lock(core->m_mutex);
+            core->m_subscribers.remove(this);
+        }
+    }
+    
+    // Restarting a stopped core drops its services, so subscribers are told that they have gone
+    // N.B. This should only be called with the lock of the core held
+    
+    void restart_core()
+    {
+        bonjour_policy::container_type<bonjour_named> services;
+        
+        std::swap(services, m_services);
+        
+        for (auto it = services.begin(); it != services.end(); it++)
+        {
+            for (auto jt = m_subscribers.begin(); jt != m_subscribers.end(); jt++)
+            {
+                (*jt)->deliver(0, *it, true);
+                (*jt)->notify_observer();
+            }
+        }
+        
+        spawn(this, regtype(), domain());
+    }
+    
     void reply(DNSServiceFlags flags, const char *name, const char *regtype, const char *domain)
     {
-        bool complete = (flags & kDNSServiceFlagsMoreComing) == 0;
+        // A subscriber may release a shared core from a callback, so it is kept alive until processing is done
+        
+        if (auto self = m_self.lock())
+            impl::deferred().push_back([self](){});
         
         bonjour_named named(name, regtype, domain);
         
         auto it = named.find(m_services);
+        bool changed = false;
         
         if (flags & kDNSServiceFlagsAdd)
         {
-            if (it == m_services.end())
+            if ((changed = it == m_services.end()))
                 m_services.push_back(named);
-                
-            notify(m_notify.m_add, this, name, regtype, domain, complete);
         }
         else
         {
-            if (it != m_services.end())
+            if ((changed = it != m_services.end()))
                 m_services.erase(it);
+        }
+        
+        deliver(flags, named, changed);
+        
+        // Subscribers may unsubscribe (or be destroyed) from a callback, so they are checked against a snapshot
+        
+        std::vector<bonjour_browse *> subscribers(m_subscribers.begin(), m_subscribers.end());
+        
+        for (auto it = subscribers.begin(); it != subscribers.end(); it++)
+        {
+            if (std::find(m_subscribers.begin(), m_subscribers.end(), *it) == m_subscribers.end())
+                continue;
+            
+            (*it)->deliver(flags, named, changed);
+            (*it)->notify_observer();
+        }
+    }
+    
+    void deliver(DNSServiceFlags flags, const bonjour_named& named, bool changed)
+    {
+        bool complete = (flags & kDNSServiceFlagsMoreComing) == 0;
+        
+        mutex_lock lock(m_mutex);
+        
+        if (flags & kDNSServiceFlagsAdd)
+        {
+            if (changed)
+            {
+                m_damping.add(named);
+                m_signal.notify();
+            }
+            
+            notify(bonjour_callback::add, m_notify.m_add, this, named.name(), named.regtype(), named.domain(), complete);
+        }
+        else
+        {
+            if (changed)
+            {
+                m_damping.remove(named);
+                m_signal.notify();
+                schedule_expiry();
+            }
+            
+            notify(bonjour_callback::remove, m_notify.m_remove, this, named.name(), named.regtype(), named.domain(), complete);
+        }
+        
+        if (changed && !m_watches.empty())
+            dispatch_watches(named, (flags & kDNSServiceFlagsAdd) != 0);
+    }
+    
+    // N.B. Callbacks are copied first so that watches can be added or removed from a callback
+    
+    void dispatch_watches(const bonjour_named& named, bool added)
+    {
+        std::vector<bonjour_notify<bonjour_browse>::watch_type> callbacks;
+        
+        auto range = m_watches.equal_range(named.identity());
+        
+        for (auto it = range.first; it != range.second; it++)
+            if (it->second.m_named.equal(named))
+                callbacks.push_back(it->second.m_callback);
+        
+        for (auto it = callbacks.begin(); it != callbacks.end(); it++)
+            notify(bonjour_callback::watch, *it, this, named.name(), named.regtype(), named.domain(), added);
+    }
+    
+    // Hold-downs that expire and suppressions that lift change the service list, so waiters are woken by a timer
+    
+    void schedule_expiry()
+    {
+        bonjour_clock::time_point when;
+        
+        if constexpr (!bonjour_policy::threaded)
+            return;
+        
+        if (!m_expiry_timer && !m_closing && m_damping.next_expiry(when))
+            m_expiry_timer = bonjour_timers::shared().schedule(when, [this](){ expired(); });
+    }
+    
+    void expired()
+    {
+        {
+            mutex_lock lock(m_mutex);
+            
+            std::list<bonjour_named> services(m_services.begin(), m_services.end());
             
-            notify(m_notify.m_remove, this, name, regtype, domain, complete);
-        }        
+            m_expiry_timer = 0;
+            m_damping.filter(services);
+            m_signal.notify();
+            schedule_expiry();
+        }
+        
+        notify_observer();
     }
     
-    std::list<bonjour_named> m_services;
+    bonjour_policy::container_type<bonjour_named> m_services;
+    bonjour_damping m_damping;
+    impl::change_signal m_signal;
+    bonjour_timers::timer_id m_expiry_timer;
+    bool m_closing;
+    
+    bool m_shared;
+    std::shared_ptr<bonjour_browse> m_core;
+    std::weak_ptr<bonjour_browse> m_self;
+    std::list<bonjour_browse *> m_subscribers;
+    
+    watch_id m_last_watch;
+    std::unordered_multimap<size_t, watch_entry> m_watches;
     
     notify_type m_notify;
 };
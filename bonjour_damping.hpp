@@ -0,0 +1,192 @@
+
+#ifndef BONJOUR_DAMPING_HPP
+#define BONJOUR_DAMPING_HPP
+
+#include "bonjour_named.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <list>
+
+// Options for flap damping (by default both the hold-down and the penalty are off)
+
+struct bonjour_damping_options
+{
+    double m_hold_down = 0.0;
+    double m_penalty = 0.0;
+    double m_suppress = 2000.0;
+    double m_reuse = 750.0;
+    double m_half_life = 30.0;
+};
+
+// An object for damping services that repeatedly appear and disappear
+// Removed services are held for the hold-down time (in seconds) before they are dropped
+// Each removal adds to a penalty that decays with the given half-life (in seconds)
+// Services whose penalty passes the suppress level are hidden until it decays below the reuse level
+
+class bonjour_damping
+{
+    using clock_type = bonjour_clock;
+    
+    struct record : public bonjour_named
+    {
+        record(const bonjour_named& named, clock_type::time_point now)
+        : bonjour_named(named)
+        , m_penalty(0.0)
+        , m_updated(now)
+        , m_removed(now)
+        , m_held(false)
+        , m_suppressed(false)
+        {}
+        
+        double m_penalty;
+        clock_type::time_point m_updated;
+        clock_type::time_point m_removed;
+        bool m_held;
+        bool m_suppressed;
+    };
+    
+public:
+    
+    bonjour_damping(bonjour_damping_options options)
+    : m_options(options)
+    {}
+    
+    bool enabled() const
+    {
+        return m_options.m_hold_down > 0.0 || m_options.m_penalty > 0.0;
+    }
+    
+    void add(const bonjour_named& named)
+    {
+        auto it = named.find(m_records);
+        
+        if (it != m_records.end())
+        {
+            decay(*it, clock_type::now());
+            it->m_held = false;
+        }
+    }
+    
+    void remove(const bonjour_named& named)
+    {
+        if (!enabled())
+            return;
+        
+        auto now = clock_type::now();
+        auto it = named.find(m_records);
+        
+        if (it == m_records.end())
+            it = m_records.emplace(m_records.end(), named, now);
+        
+        decay(*it, now);
+        
+        it->m_penalty += m_options.m_penalty;
+        it->m_removed = now;
+        it->m_held = m_options.m_hold_down > 0.0;
+        
+        if (m_options.m_penalty > 0.0 && it->m_penalty > m_options.m_suppress)
+            it->m_suppressed = true;
+    }
+    
+    // Converts a list of the services currently present to the damped view
+    
+    void filter(std::list<bonjour_named>& services)
+    {
+        auto now = clock_type::now();
+        
+        for (auto it = m_records.begin(); it != m_records.end(); )
+        {
+            decay(*it, now);
+            
+            if (it->m_held && seconds(now - it->m_removed) >= m_options.m_hold_down)
+                it->m_held = false;
+            
+            // Forget records that no longer have any effect
+            
+            if (!it->m_held && !it->m_suppressed && it->m_penalty < forget_level())
+            {
+                it = m_records.erase(it);
+                continue;
+            }
+            
+            auto jt = it->find(services);
+            
+            if (it->m_suppressed)
+            {
+                if (jt != services.end())
+                    services.erase(jt);
+            }
+            else if (it->m_held && jt == services.end())
+                services.push_back(*it);
+            
+            it++;
+        }
+    }
+    
+    // Finds when the next hold-down ends or suppression lifts (returning false if neither will happen)
+    
+    bool next_expiry(clock_type::time_point& when) const
+    {
+        bool found = false;
+        
+        for (auto it = m_records.begin(); it != m_records.end(); it++)
+        {
+            clock_type::time_point expiry;
+            
+            if (it->m_held)
+                expiry = it->m_removed + to_duration(m_options.m_hold_down);
+            else if (it->m_suppressed && m_options.m_half_life > 0.0 && m_options.m_reuse > 0.0)
+                expiry = it->m_updated + to_duration(m_options.m_half_life * std::log2(it->m_penalty / m_options.m_reuse));
+            else
+                continue;
+            
+            if (!found || expiry < when)
+                when = expiry;
+            
+            found = true;
+        }
+        
+        return found;
+    }
+    
+    void clear()
+    {
+        m_records.clear();
+    }
+    
+private:
+    
+    static double seconds(clock_type::duration duration)
+    {
+        return std::chrono::duration<double>(duration).count();
+    }
+    
+    static clock_type::duration to_duration(double seconds)
+    {
+        return std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(seconds));
+    }
+    
+    // Penalties are kept until they decay to half the reuse level (or half a single penalty if that is smaller)
+    
+    double forget_level() const
+    {
+        return std::min(m_options.m_reuse, m_options.m_penalty) * 0.5;
+    }
+    
+    void decay(record& r, clock_type::time_point now)
+    {
+        if (m_options.m_half_life > 0.0)
+            r.m_penalty *= std::exp2(-seconds(now - r.m_updated) / m_options.m_half_life);
+        
+        r.m_updated = now;
+        
+        if (r.m_suppressed && r.m_penalty < m_options.m_reuse)
+            r.m_suppressed = false;
+    }
+    
+    bonjour_damping_options m_options;
+    std::list<record> m_records;
+};
+
+#endif /* BONJOUR_DAMPING_HPP */
@@ -0,0 +1,290 @@
+
+#ifndef BONJOUR_EVENTS_HPP
+#define BONJOUR_EVENTS_HPP
+
+#include "bonjour_browse.hpp"
+#include "bonjour_named.hpp"
+#include "bonjour_service.hpp"
+#include "bonjour_txt.hpp"
+
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// An event for a service (resolve events also carry the resolved details)
+
+struct bonjour_event : public bonjour_named
+{
+    enum class kinds { add, remove, resolve };
+    
+    bonjour_event(kinds kind, const char *name, const char *regtype, const char *domain)
+    : bonjour_named(name, regtype, domain)
+    , m_kind(kind)
+    , m_port(0)
+    {}
+    
+    kinds m_kind;
+    
+    std::string m_fullname;
+    std::string m_host;
+    uint16_t m_port;
+    bonjour_txt m_txt;
+};
+
+// A bounded queue of events that keeps only the latest events for each service
+// A pending event is replaced by a later event of the same sort for the same service (keeping its place in the queue)
+// Adds and removes replace each other, whereas resolves only replace resolves (so an add is never lost to a resolve)
+// If the queue is full events for new services are dropped and the queue is marked as overflowed
+// Consumers should then resynchronise (for example from bonjour_browse::list_services())
+
+class bonjour_event_queue
+{
+public:
+    
+    bonjour_event_queue(size_t capacity = 1024)
+    : m_capacity(capacity < 1 ? 1 : capacity)
+    , m_overflowed(false)
+    {}
+    
+    bonjour_event_queue(bonjour_event_queue const& rhs) = delete;
+    void operator = (bonjour_event_queue const& rhs) = delete;
+    
+    void push(const bonjour_event& event)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            
+            auto it = find(event);
+            
+            if (it != m_events.end())
+                *it = event;
+            else if (m_events.size() < m_capacity)
+                m_index.emplace(event.identity(), m_events.insert(m_events.end(), event));
+            else
+            {
+                m_overflowed = true;
+                return;
+            }
+        }
+        
+        m_cond.notify_one();
+    }
+    
+    // Returns false if there are no events
+    
+    bool pop(bonjour_event& event)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return take(event);
+    }
+    
+    // Returns false if the deadline passes before there is an event
+    
+    bool pop(bonjour_event& event, bonjour_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        
+        if (!m_cond.wait_until(lock, deadline, [&](){ return !m_events.empty(); }))
+            return false;
+        
+        return take(event);
+    }
+    
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_events.size();
+    }
+    
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+    
+    // Returns true if events have been dropped since the last call
+    
+    bool overflowed()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        bool overflowed = m_overflowed;
+        m_overflowed = false;
+        return overflowed;
+    }
+    
+private:
+    
+    using event_list = std::list<bonjour_event>;
+    
+    static bool membership(bonjour_event::kinds kind)
+    {
+        return kind != bonjour_event::kinds::resolve;
+    }
+    
+    // Pending events are indexed by the identity of their service (so pushes don't search the queue)
+    
+    event_list::iterator find(const bonjour_event& event)
+    {
+        auto range = m_index.equal_range(event.identity());
+        
+        for (auto it = range.first; it != range.second; it++)
+            if (membership(it->second->m_kind) == membership(event.m_kind) && it->second->equal(event))
+                return it->second;
+        
+        return m_events.end();
+    }
+    
+    bool take(bonjour_event& event)
+    {
+        if (m_events.empty())
+            return false;
+        
+        auto range = m_index.equal_range(m_events.front().identity());
+        
+        for (auto it = range.first; it != range.second; it++)
+        {
+            if (it->second == m_events.begin())
+            {
+                m_index.erase(it);
+                break;
+            }
+        }
+        
+        event = m_events.front();
+        m_events.pop_front();
+        return true;
+    }
+    
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+    event_list m_events;
+    std::unordered_multimap<size_t, event_list::iterator> m_index;
+    size_t m_capacity;
+    bool m_overflowed;
+};
+
+// A browse that delivers its adds and removes to an event queue
+
+class bonjour_queued_browse : public bonjour_browse
+{
+public:
+    
+    bonjour_queued_browse(const char *regtype,
+                          const char *domain,
+                          std::shared_ptr<bonjour_event_queue> queue,
+                          bonjour_browse_options options = bonjour_browse_options())
+    : bonjour_browse(regtype, domain, make_notify(), options)
+    , m_queue(queue)
+    {}
+    
+    std::shared_ptr<bonjour_event_queue> queue() const
+    {
+        return m_queue;
+    }
+    
+private:
+    
+    static notify_type make_notify()
+    {
+        notify_type notify;
+        notify.m_add = added;
+        notify.m_remove = removed;
+        return notify;
+    }
+    
+    static void added(bonjour_browse *object, const char *name, const char *regtype, const char *domain, bool)
+    {
+        auto browse = static_cast<bonjour_queued_browse *>(object);
+        browse->m_queue->push(bonjour_event(bonjour_event::kinds::add, name, regtype, domain));
+    }
+    
+    static void removed(bonjour_browse *object, const char *name, const char *regtype, const char *domain, bool)
+    {
+        auto browse = static_cast<bonjour_queued_browse *>(object);
+        browse->m_queue->push(bonjour_event(bonjour_event::kinds::remove, name, regtype, domain));
+    }
+    
+    std::shared_ptr<bonjour_event_queue> m_queue;
+};
+
+// A resolve that delivers its results to an event queue (monitored resolves deliver every change)
+
+class bonjour_queued_resolve
+{
+    // N.B. The queue is a base so that it is set before the resolve starts in the service constructor
+    
+    struct queue_holder
+    {
+        std::shared_ptr<bonjour_event_queue> m_queue;
+    };
+    
+    class resolver : private queue_holder, public bonjour_service
+    {
+    public:
+        
+        resolver(std::shared_ptr<bonjour_event_queue> queue, const bonjour_named& named, bool monitor)
+        : queue_holder{ queue }
+        , bonjour_service(named, make_notify(), false, monitor)
+        {}
+        
+    private:
+        
+        static notify_type make_notify()
+        {
+            notify_type notify;
+            notify.m_resolve = resolved;
+            return notify;
+        }
+        
+        static void resolved(bonjour_service *object, const char *fullname, const char *host, uint16_t port, bool)
+        {
+            auto service = static_cast<resolver *>(object);
+            
+            bonjour_event event(bonjour_event::kinds::resolve, service->name(), service->regtype(), service->domain());
+            
+            event.m_fullname = fullname;
+            event.m_host = host;
+            event.m_port = port;
+            event.m_txt = service->txt();
+            
+            service->m_queue->push(event);
+        }
+    };
+    
+public:
+    
+    bonjour_queued_resolve(const bonjour_named& named, std::shared_ptr<bonjour_event_queue> queue, bool monitor = false)
+    : m_resolver(new resolver(queue, named, monitor))
+    {}
+    
+    bonjour_queued_resolve(bonjour_queued_resolve const& rhs) = delete;
+    void operator = (bonjour_queued_resolve const& rhs) = delete;
+    
+    bool resolve()
+    {
+        return m_resolver->resolve();
+    }
+    
+    void stop()
+    {
+        m_resolver->stop();
+    }
+    
+    bool resolving() const
+    {
+        return m_resolver->resolving();
+    }
+    
+    const bonjour_service& service() const
+    {
+        return *m_resolver;
+    }
+    
+private:
+    
+    std::unique_ptr<resolver> m_resolver;
+};
+
+#endif /* BONJOUR_EVENTS_HPP */
@@ -0,0 +1,176 @@
+
+#ifndef BONJOUR_EXECUTOR_HPP
+#define BONJOUR_EXECUTOR_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+// An executor posts tasks to be run elsewhere (for example on a thread pool)
+// Objects given an executor in their notify_type run their notifications through it in order
+
+using bonjour_executor = std::function<void(std::function<void()>)>;
+
+namespace impl
+{
+    // True whilst on a thread processing replies or running notifications (where waiting for notifications could deadlock)
+    
+    inline bool& in_callback()
+    {
+        thread_local bool in = false;
+        return in;
+    }
+    
+    // Strings from replies are only valid during the reply, so they are copied when notifications are posted
+    
+    template <class T, std::enable_if_t<!std::is_convertible<T, const char *>::value, bool> = true>
+    T hold(T value)
+    {
+        return value;
+    }
+    
+    inline std::string hold(const char *str)
+    {
+        return str ? str : "";
+    }
+    
+    template <class T>
+    const T& pass(const T& value)
+    {
+        return value;
+    }
+    
+    inline const char *pass(const std::string& str)
+    {
+        return str.c_str();
+    }
+    
+    // The lifetime of an object as seen by its queued notifications
+    // Tasks hold the lock whilst they run, so ending a lifetime waits for a running task (and drops later ones)
+    
+    struct lifetime
+    {
+        void end()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_alive = false;
+        }
+        
+        std::mutex m_mutex;
+        bool m_alive = true;
+    };
+    
+    // Runs tasks through an executor one at a time in the order they were posted
+    // Only one task of a strand runs at once, but different strands may run in parallel
+    
+    class strand : public std::enable_shared_from_this<strand>
+    {
+    public:
+        
+        strand(bonjour_executor executor)
+        : m_executor(executor)
+        , m_running(false)
+        {}
+        
+        void post(std::function<void()> task)
+        {
+            bool idle;
+            
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_tasks.push_back(std::move(task));
+                idle = !m_running;
+                m_running = true;
+            }
+            
+            if (idle)
+                schedule();
+        }
+        
+        // True on the thread currently running a task of this strand
+        
+        bool running_here() const
+        {
+            return current() == this;
+        }
+        
+        // Waits until every task posted so far has run
+        
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [&](){ return !m_running; });
+        }
+    
+    private:
+        
+        // Tasks are run in batches so that a busy strand does not hold on to an executor thread
+        
+        static constexpr int batch_size = 16;
+        
+        static const strand *& current()
+        {
+            thread_local const strand *running = nullptr;
+            return running;
+        }
+        
+        void schedule()
+        {
+            auto self = shared_from_this();
+            m_executor([self](){ self->run(); });
+        }
+        
+        void run()
+        {
+            bool in = impl::in_callback();
+            bool done = false;
+            auto previous = current();
+            
+            impl::in_callback() = true;
+            current() = this;
+            
+            for (int i = 0; i < batch_size && !done; i++)
+            {
+                std::function<void()> task;
+                
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    
+                    if (m_tasks.empty())
+                    {
+                        m_running = false;
+                        m_cond.notify_all();
+                        done = true;
+                        continue;
+                    }
+                    
+                    task = std::move(m_tasks.front());
+                    m_tasks.pop_front();
+                }
+                
+                task();
+            }
+            
+            impl::in_callback() = in;
+            current() = previous;
+            
+            // N.B. The strand is still marked as running, so nothing else can schedule it in the meantime
+            
+            if (!done)
+                schedule();
+        }
+        
+        bonjour_executor m_executor;
+        
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        std::list<std::function<void()>> m_tasks;
+        bool m_running;
+    };
+}
+
+#endif /* BONJOUR_EXECUTOR_HPP */
@@ -0,0 +1,278 @@
+
+#ifndef BONJOUR_LOCK_STATS_HPP
+#define BONJOUR_LOCK_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+
+// Statistics for the locks of one class of object (times are in seconds)
+// Waits include uncontended acquisitions and holds are measured from the outermost lock to the final unlock
+
+struct bonjour_lock_stats
+{
+    std::string m_class;
+    
+    uint64_t m_acquisitions = 0;
+    uint64_t m_contended = 0;
+    
+    double m_wait = 0.0;
+    double m_max_wait = 0.0;
+    double m_hold = 0.0;
+    double m_max_hold = 0.0;
+};
+
+// Lock profiling of the library's internal mutexes (define BONJOUR_FOR_CPP_LOCK_STATS before including any header)
+// Without the define the mutexes are not wrapped and no statistics are gathered
+
+class bonjour_lock_profile
+{
+    struct entry
+    {
+        entry(const char *name) : m_class(name) {}
+        
+        const char *m_class;
+        
+        std::atomic<uint64_t> m_acquisitions { 0 };
+        std::atomic<uint64_t> m_contended { 0 };
+        
+        std::atomic<uint64_t> m_wait { 0 };
+        std::atomic<uint64_t> m_max_wait { 0 };
+        std::atomic<uint64_t> m_hold { 0 };
+        std::atomic<uint64_t> m_max_hold { 0 };
+    };
+    
+    struct registry
+    {
+        std::mutex m_mutex;
+        std::list<entry> m_entries;
+    };
+    
+    template <class M>
+    friend class bonjour_profiled_mutex;
+    
+public:
+    
+    static constexpr bool enabled()
+    {
+#ifdef BONJOUR_FOR_CPP_LOCK_STATS
+        return true;
+#else
+        return false;
+#endif
+    }
+    
+    static void stats(std::list<bonjour_lock_stats>& stats)
+    {
+        auto& profile = entries();
+        std::lock_guard<std::mutex> lock(profile.m_mutex);
+        
+        stats.clear();
+        
+        for (auto it = profile.m_entries.begin(); it != profile.m_entries.end(); it++)
+        {
+            bonjour_lock_stats entry_stats;
+            
+            entry_stats.m_class = it->m_class;
+            entry_stats.m_acquisitions = it->m_acquisitions;
+            entry_stats.m_contended = it->m_contended;
+            entry_stats.m_wait = seconds(it->m_wait);
+            entry_stats.m_max_wait = seconds(it->m_max_wait);
+            entry_stats.m_hold = seconds(it->m_hold);
+            entry_stats.m_max_hold = seconds(it->m_max_hold);
+            
+            stats.push_back(entry_stats);
+        }
+    }
+    
+    static void reset()
+    {
+        auto& profile = entries();
+        std::lock_guard<std::mutex> lock(profile.m_mutex);
+        
+        for (auto it = profile.m_entries.begin(); it != profile.m_entries.end(); it++)
+        {
+            it->m_acquisitions = 0;
+            it->m_contended = 0;
+            it->m_wait = 0;
+            it->m_max_wait = 0;
+            it->m_hold = 0;
+            it->m_max_hold = 0;
+        }
+    }
+    
+private:
+    
+    // N.B. This is never destroyed as mutexes of detached threads may still be in use at exit
+    
+    static registry& entries()
+    {
+        static registry *profile = new registry;
+        return *profile;
+    }
+    
+    // Entries are never removed, so they can be referred to by pointer
+    
+    static entry *find(const char *name)
+    {
+        auto& profile = entries();
+        std::lock_guard<std::mutex> lock(profile.m_mutex);
+        
+        for (auto it = profile.m_entries.begin(); it != profile.m_entries.end(); it++)
+            if (!strcmp(it->m_class, name))
+                return &*it;
+        
+        profile.m_entries.emplace_back(name);
+        return &profile.m_entries.back();
+    }
+    
+    static double seconds(uint64_t nanoseconds)
+    {
+        return static_cast<double>(nanoseconds) * 1e-9;
+    }
+    
+    static void record_max(std::atomic<uint64_t>& max, uint64_t value)
+    {
+        uint64_t current = max;
+        
+        while (value > current && !max.compare_exchange_weak(current, value));
+    }
+};
+
+// A mutex that records its wait and hold times against a class of object (names should be string literals)
+
+template <class M>
+class bonjour_profiled_mutex
+{
+    using clock = std::chrono::steady_clock;
+    
+public:
+    
+    bonjour_profiled_mutex(const char *name = "unclassified")
+    : m_entry(bonjour_lock_profile::find(name))
+    , m_depth(0)
+    {}
+    
+    bonjour_profiled_mutex(bonjour_profiled_mutex const& rhs) = delete;
+    void operator = (bonjour_profiled_mutex const& rhs) = delete;
+    
+    void set_class(const char *name)
+    {
+        m_entry = bonjour_lock_profile::find(name);
+    }
+    
+    const char *get_class() const
+    {
+        return m_entry->m_class;
+    }
+    
+    void lock()
+    {
+        auto start = clock::now();
+        bool contended = !m_mutex.try_lock();
+        
+        if (contended)
+            m_mutex.lock();
+        
+        acquired(start, contended);
+    }
+    
+    bool try_lock()
+    {
+        auto start = clock::now();
+        
+        if (!m_mutex.try_lock())
+            return false;
+        
+        acquired(start, false);
+        return true;
+    }
+    
+    void unlock()
+    {
+        // N.B. Only the outermost lock of a recursive mutex is counted
+        
+        if (!--m_depth)
+        {
+            uint64_t hold = nanoseconds(clock::now() - m_acquired);
+            
+            m_entry->m_hold += hold;
+            bonjour_lock_profile::record_max(m_entry->m_max_hold, hold);
+        }
+        
+        m_mutex.unlock();
+    }
+    
+private:
+    
+    static uint64_t nanoseconds(clock::duration duration)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    }
+    
+    // The depth and acquisition time are only accessed whilst the mutex is held
+    
+    void acquired(clock::time_point start, bool contended)
+    {
+        if (m_depth++)
+            return;
+        
+        m_acquired = clock::now();
+        
+        uint64_t wait = nanoseconds(m_acquired - start);
+        
+        m_entry->m_acquisitions++;
+        m_entry->m_wait += wait;
+        bonjour_lock_profile::record_max(m_entry->m_max_wait, wait);
+        
+        if (contended)
+            m_entry->m_contended++;
+    }
+    
+    M m_mutex;
+    bonjour_lock_profile::entry *m_entry;
+    int m_depth;
+    clock::time_point m_acquired;
+};
+
+namespace impl
+{
+    // The mutex types used internally (which are only wrapped when profiling)
+
+#ifdef BONJOUR_FOR_CPP_LOCK_STATS
+    template <class M>
+    using profiled = bonjour_profiled_mutex<M>;
+#else
+    template <class M>
+    using profiled = M;
+#endif
+    
+    // Sets the class that a mutex is profiled as (doing nothing for other mutexes)
+    
+    template <class M>
+    void set_lock_class(M&, const char *) {}
+    
+    template <class M>
+    void set_lock_class(bonjour_profiled_mutex<M>& mutex, const char *name)
+    {
+        mutex.set_class(name);
+    }
+    
+    template <class M>
+    const char *lock_class(const M&)
+    {
+        return nullptr;
+    }
+    
+    template <class M>
+    const char *lock_class(const bonjour_profiled_mutex<M>& mutex)
+    {
+        return mutex.get_class();
+    }
+}
+
+#endif /* BONJOUR_LOCK_STATS_HPP */
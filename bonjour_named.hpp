@@ -5,7 +5,9 @@
 #include "bonjour_base.hpp"
 
 #include <cstring>
+#include <functional>
 #include <list>
+#include <string_view>
 #include <type_traits>
 
 // A representation of a named bonjour service
@@ -18,7 +20,16 @@ public:
     bonjour_named(const char *name, const char *regtype, const char *domain)
     : bonjour_base(regtype, domain)
     , m_name(impl::validate_name(name))
-    {}
+    {
+        impl::set_lock_class(m_mutex, "bonjour_named");
+    }
+    
+    bonjour_named(const char *name, impl::static_regtype regtype, const char *domain)
+    : bonjour_base(regtype, domain)
+    , m_name(impl::validate_name(name))
+    {
+        impl::set_lock_class(m_mutex, "bonjour_named");
+    }
     
     const char *name() const
     {
@@ -30,8 +41,21 @@ public:
         return equal(name(), b.name()) && equal(regtype(), b.regtype()) && equal(domain(), b.domain());
     }
     
-    template <class T, std::enable_if_t<std::is_base_of<bonjour_named, T>::value, bool> = true>
-    typename std::list<T>::iterator find(std::list<T>& list) const
+    // A hash of the name, regtype and domain (equal services have equal hashes)
+    
+    size_t identity() const
+    {
+        std::hash<std::string_view> hasher;
+        
+        size_t hash = hasher(name());
+        hash ^= hasher(regtype()) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        hash ^= hasher(domain()) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        
+        return hash;
+    }
+    
+    template <class C, std::enable_if_t<std::is_base_of<bonjour_named, typename C::value_type>::value, bool> = true>
+    typename C::iterator find(C& list) const
     {
         for (auto it = list.begin(); it != list.end(); it++)
             if (it->equal(*this))
@@ -6,7 +6,12 @@
 #include "bonjour_register.hpp"
 #include "bonjour_service.hpp"
 
+#include <atomic>
 #include <list>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // Options for bonjour_peer
 
@@ -16,11 +21,40 @@ struct bonjour_peer_options
 
     modes m_mode = modes::both;
     bool m_self_discover = false;
+    
+    // Flap damping keeps briefly vanished peers (and their resolved state) in the list of peers
+    
+    bonjour_browse_options m_browse;
+    
+    // Naming and conflict handling for the registration
+    
+    bonjour_register_options m_register;
+    
+    // Auto-resolve runs browse -> resolve -> address lookup in the background with bounded concurrency
+    // list_peers() then only reports peers that are ready to use
+    
+    bool m_auto_resolve = false;
+    size_t m_max_resolves = 8;
+    size_t m_max_lookups = 8;
+    
+    // Resolves and lookups that take longer than the stage timeout (in seconds) are retried later
+    
+    double m_stage_timeout = 10.0;
+    
+    // Lazy resolution only resolves a peer when its host or port is first accessed (ignored with auto-resolve)
+    
+    bool m_lazy_resolve = false;
+    
+    // Draining peers are left out of list_peers() (resolved peers are then resolved again every drain check interval)
+    // N.B. Lazy peers are only known to be draining once something has resolved them (and are not resolved again)
+    
+    bool m_skip_draining = false;
+    double m_drain_check = 5.0;
 };
 
 // An object that is a peer service (and so offers both registration and browsing)
 // This object resolves peers and assumes you will poll externally when required
-// It has no notification facilities
+// It has no notification facilities, but callers can block until the peers change
 
 class bonjour_peer
 {
@@ -32,11 +66,45 @@ public:
                  uint16_t port,
                  bonjour_peer_options options = bonjour_peer_options())
     : m_options(options)
-    , m_register(name, regtype, domain, port)
-    , m_browse(regtype, domain)
-    , m_this_service(m_register)
+    , m_register(name, regtype, domain, port, bonjour_register::notify_type(), options.m_register)
+    , m_browse(regtype, domain, bonjour_browse::notify_type(), options.m_browse)
+    , m_this_service(m_register, bonjour_service::notify_type(), true)
+    , m_signal(std::make_shared<impl::change_signal>())
+    , m_running(false)
     {
-        m_this_service.resolve();
+        impl::set_lock_class(m_mutex, "bonjour_peer");
+        m_browse.observe(m_signal);
+        
+        // Only peers that register have a service of their own to resolve
+        
+        if (advertises())
+            m_this_service.resolve();
+    }
+    
+    bonjour_peer(const char *name,
+                 impl::static_regtype regtype,
+                 const char *domain,
+                 uint16_t port,
+                 bonjour_peer_options options = bonjour_peer_options())
+    : m_options(options)
+    , m_register(name, regtype, domain, port, bonjour_register::notify_type(), options.m_register)
+    , m_browse(regtype, domain, bonjour_browse::notify_type(), options.m_browse)
+    , m_this_service(m_register, bonjour_service::notify_type(), true)
+    , m_signal(std::make_shared<impl::change_signal>())
+    , m_running(false)
+    {
+        impl::set_lock_class(m_mutex, "bonjour_peer");
+        m_browse.observe(m_signal);
+        
+        // Only peers that register have a service of their own to resolve
+        
+        if (advertises())
+            m_this_service.resolve();
+    }
+    
+    ~bonjour_peer()
+    {
+        stop_pipeline();
     }
     
     bool start()
@@ -44,18 +112,19 @@ public:
         switch (m_options.m_mode)
         {
             case bonjour_peer_options::modes::browse_only:
-                return m_browse.start();
+                return m_browse.start() && start_pipeline();
                 
             case bonjour_peer_options::modes::register_only:
                 return m_register.start();
                 
             default:
-                return m_register.start() && m_browse.start();
+                return m_register.start() && m_browse.start() && start_pipeline();
         }
     }
     
     void stop()
     {
+        stop_pipeline();
         m_register.stop();
         m_browse.stop();
     }
@@ -63,6 +132,7 @@ public:
     void clear()
     {
         m_browse.clear();
+        m_signal->notify();
     }
     
     const char *name() const
@@ -87,7 +157,7 @@ public:
     
     void resolve()
     {
-        std::unique_lock<std::mutex> lock(m_mutex);
+        mutex_lock lock(m_mutex);
 
         for (auto it = m_peers.begin(); it != m_peers.end(); it++)
             it->resolve();
@@ -95,7 +165,7 @@ public:
     
     void resolve(const bonjour_named& service)
     {
-        std::unique_lock<std::mutex> lock(m_mutex);
+        mutex_lock lock(m_mutex);
         
         auto it = service.find(m_peers);
         
@@ -107,7 +177,15 @@ public:
     {
         std::list<bonjour_named> services;
 
-        std::unique_lock<std::mutex> lock(m_mutex);
+        mutex_lock lock(m_mutex);
+        
+        // With auto-resolve the pipeline maintains the list of peers
+        
+        if (auto_resolve())
+        {
+            copy_peers(peers);
+            return;
+        }
         
         m_browse.list_services(services);
         
@@ -127,30 +205,468 @@ public:
         
         // Add any new items to the list (noting if self-discovery is allowed)
         
+        const auto self = registered_self();
+        
         for (auto it = services.begin(); it != services.end(); it++)
         {
-            if (m_options.m_self_discover || !it->equal(m_register))
-                m_peers.emplace_back(*it);
+            if (m_options.m_self_discover || !it->equal(self))
+                m_peers.emplace_back(*it, bonjour_service::notify_type(), m_options.m_lazy_resolve);
+        }
+        
+        check_draining(bonjour_clock::now());
+        copy_peers(peers);
+    }
+    
+    // Without threads every socket of the peer should be added to the user's event loop
+    // The sockets change as operations start and finish, so they should be collected again after processing
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    void sockets(std::vector<int>& sockets)
+    {
+        sockets.clear();
+        
+        if (m_register.socket<P>() >= 0)
+            sockets.push_back(m_register.socket<P>());
+        
+        if (m_browse.socket<P>() >= 0)
+            sockets.push_back(m_browse.socket<P>());
+        
+        this_service().sockets<P>(sockets);
+        
+        mutex_lock lock(m_mutex);
+        
+        for (auto it = m_peers.begin(); it != m_peers.end(); it++)
+            it->sockets<P>(sockets);
+    }
+    
+    // Processes replies for a readable socket (returning false if the socket does not belong to this peer)
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    bool process(int fd)
+    {
+        if (fd < 0)
+            return false;
+        
+        if (m_register.socket<P>() == fd)
+            m_register.process<P>();
+        else if (m_browse.socket<P>() == fd)
+            m_browse.process<P>();
+        else if (!this_service().process<P>(fd))
+        {
+            mutex_lock lock(m_mutex);
+            
+            for (auto it = m_peers.begin(); it != m_peers.end(); it++)
+                if (it->process<P>(fd))
+                    return true;
+            
+            return false;
         }
         
-        peers = m_peers;
+        return true;
+    }
+    
+    // Observe changes to the peers (the signal is notified whenever the peers may have changed)
+    // With auto-resolve this is when the pipeline adds or removes peers (otherwise it follows the browse)
+    
+    void observe(std::shared_ptr<impl::change_signal> signal)
+    {
+        if (!auto_resolve())
+        {
+            m_browse.observe(signal);
+            return;
+        }
+        
+        mutex_lock lock(m_mutex);
+        m_observer = signal;
+    }
+    
+    // The generation increments whenever the peers reported by list_peers() may have changed
+    // With auto-resolve this is when the pipeline changes the peers (otherwise the peers follow the browse)
+    // N.B. Without auto-resolve draining peers are only noticed when the peers are listed
+    
+    uint64_t generation() const
+    {
+        return auto_resolve() ? m_peers_signal.generation() : m_browse.generation();
+    }
+    
+    // Blocking waits (these return false if the deadline passes first)
+    
+    bool wait_for_change(uint64_t generation, bonjour_clock::time_point deadline)
+    {
+        if (auto_resolve())
+            return m_peers_signal.wait_for_change(generation, deadline);
+        
+        return m_browse.wait_for_change(generation, deadline);
+    }
+    
+    // Waits until list_peers() reports at least count peers
+    
+    bool wait_for_peers(size_t count, bonjour_clock::time_point deadline)
+    {
+        std::list<bonjour_service> peers;
+        
+        while (true)
+        {
+            auto generation = this->generation();
+            
+            list_peers(peers);
+            
+            if (peers.size() >= count)
+                return true;
+            
+            if (!wait_for_change(generation, deadline))
+                return false;
+        }
     }
     
     std::string resolved_host() const
     {
-        return m_this_service.host();
+        return this_service().host();
     }
     
 private:
     
+    // Auto-resolve pipeline (this needs its own thread so is disabled with a single-threaded policy)
+    
+    bool auto_resolve() const
+    {
+        return bonjour_policy::threaded && m_options.m_auto_resolve;
+    }
+    
+    bool advertises() const
+    {
+        return m_options.m_mode != bonjour_peer_options::modes::browse_only && strlen(m_register.name());
+    }
+    
+    bool start_pipeline()
+    {
+        if (auto_resolve() && !m_pipeline.joinable())
+        {
+            m_running = true;
+            m_pipeline = std::thread(do_pipeline, this);
+        }
+        
+        return true;
+    }
+    
+    void stop_pipeline()
+    {
+        if (m_pipeline.joinable())
+        {
+            m_running = false;
+            m_signal->notify();
+            m_pipeline.join();
+        }
+    }
+    
+    static void do_pipeline(bonjour_peer *peer)
+    {
+        peer->pipeline();
+    }
+    
+    // Failed operations are retried on a fixed interval (however busy the browse is)
+    
+    void pipeline()
+    {
+        const auto retry_interval = std::chrono::seconds(1);
+        auto retry = bonjour_clock::now() + retry_interval;
+        
+        while (m_running)
+        {
+            auto generation = m_signal->generation();
+            
+            std::shared_ptr<impl::change_signal> observer;
+            bool changed;
+            
+            {
+                mutex_lock lock(m_mutex);
+                
+                if (bonjour_clock::now() >= retry)
+                {
+                    m_resolve_queue.splice(m_resolve_queue.end(), m_retry);
+                    retry = bonjour_clock::now() + retry_interval;
+                }
+                
+                changed = advance_pipeline();
+                observer = m_observer;
+            }
+            
+            if (changed)
+                m_peers_signal.notify();
+            
+            if (changed && observer)
+                observer->notify();
+            
+            // N.B. Waking at the retry time also runs the stage timeouts and drain checks
+            
+            m_signal->wait_for_change(generation, retry);
+        }
+    }
+    
+    // Returns true if the peers have changed
+    
+    bool advance_pipeline()
+    {
+        std::list<bonjour_named> services;
+        
+        m_browse.list_services(services);
+        
+        const auto count = m_peers.size();
+        bool changed = false;
+        
+        // Remove services that have gone from every stage
+        
+        prune(m_resolve_queue, services);
+        prune(m_retry, services);
+        prune(m_resolving, services);
+        prune(m_lookup_queue, services);
+        prune(m_looking_up, services);
+        prune(m_peers, services);
+        
+        changed = m_peers.size() != count;
+        
+        // Queue new services
+        
+        const auto self = registered_self();
+        
+        for (auto it = services.begin(); it != services.end(); it++)
+        {
+            if (!m_options.m_self_discover && it->equal(self))
+                continue;
+            
+            if (it->find(m_resolve_queue) == m_resolve_queue.end() &&
+                it->find(m_retry) == m_retry.end() &&
+                it->find(m_resolving) == m_resolving.end() &&
+                it->find(m_lookup_queue) == m_lookup_queue.end() &&
+                it->find(m_looking_up) == m_looking_up.end() &&
+                it->find(m_peers) == m_peers.end())
+                m_resolve_queue.push_back(*it);
+        }
+        
+        prune_deadlines();
+        
+        auto now = bonjour_clock::now();
+        
+        // Resolve stage (note that services start resolving on construction)
+        
+        while (m_resolving.size() < m_options.m_max_resolves && !m_resolve_queue.empty())
+        {
+            m_resolving.emplace_back(m_resolve_queue.front(), bonjour_service::notify_type());
+            m_resolving.back().observe(m_signal);
+            m_resolve_queue.pop_front();
+            set_deadline(m_resolving.back(), now);
+        }
+        
+        for (auto it = m_resolving.begin(); it != m_resolving.end(); )
+        {
+            auto jt = it++;
+            
+            if (jt->resolved())
+            {
+                m_deadlines.erase(deadline_key(*jt));
+                m_lookup_queue.splice(m_lookup_queue.end(), m_resolving, jt);
+            }
+            else if (!jt->resolving() || expired(*jt, now))
+                fail(m_resolving, jt);
+        }
+        
+        // Address lookup stage
+        
+        while (m_looking_up.size() < m_options.m_max_lookups && !m_lookup_queue.empty())
+        {
+            if (m_lookup_queue.front().lookup())
+            {
+                set_deadline(m_lookup_queue.front(), now);
+                m_looking_up.splice(m_looking_up.end(), m_lookup_queue, m_lookup_queue.begin());
+            }
+            else
+                fail(m_lookup_queue, m_lookup_queue.begin());
+        }
+        
+        for (auto it = m_looking_up.begin(); it != m_looking_up.end(); )
+        {
+            auto jt = it++;
+            
+            if (!jt->address().empty())
+            {
+                m_deadlines.erase(deadline_key(*jt));
+                m_peers.splice(m_peers.end(), m_looking_up, jt);
+                changed = true;
+            }
+            else if (!jt->looking_up() || expired(*jt, now))
+                fail(m_looking_up, jt);
+        }
+        
+        return check_draining(now) || changed;
+    }
+    
+    // Peers are resolved again from time to time to see if they have started draining (from their TXT records)
+    // This costs a short resolve per peer per interval (rather than a continuous resolve and thread per peer)
+    // Returns true if the number of draining peers has changed
+    
+    bool check_draining(bonjour_clock::time_point now)
+    {
+        if (!m_options.m_skip_draining)
+            return false;
+        
+        bool check = m_options.m_drain_check > 0.0 && now >= m_next_drain_check;
+        size_t draining = 0;
+        
+        for (auto it = m_peers.begin(); it != m_peers.end(); it++)
+        {
+            if (check && it->resolved() && !it->resolving())
+                it->resolve();
+            
+            if (it->draining())
+                draining++;
+        }
+        
+        if (check)
+        {
+            auto interval = std::chrono::duration<double>(m_options.m_drain_check);
+            m_next_drain_check = now + std::chrono::duration_cast<bonjour_clock::duration>(interval);
+        }
+        
+        bool changed = draining != m_draining_peers;
+        m_draining_peers = draining;
+        
+        return changed;
+    }
+    
+    // Deadlines for the resolve and lookup stages (so that stuck operations do not hold their slots forever)
+    // N.B. Deadlines are keyed by the full name, regtype and domain (identity() hashes can collide)
+    
+    static std::string deadline_key(const bonjour_named& service)
+    {
+        return std::string(service.name()) + '\0' + service.regtype() + '\0' + service.domain();
+    }
+    
+    void set_deadline(const bonjour_service& service, bonjour_clock::time_point now)
+    {
+        auto timeout = std::chrono::duration<double>(m_options.m_stage_timeout);
+        
+        m_deadlines[deadline_key(service)] = now + std::chrono::duration_cast<bonjour_clock::duration>(timeout);
+    }
+    
+    bool expired(const bonjour_service& service, bonjour_clock::time_point now) const
+    {
+        auto it = m_deadlines.find(deadline_key(service));
+        
+        return m_options.m_stage_timeout > 0.0 && it != m_deadlines.end() && now >= it->second;
+    }
+    
+    void prune_deadlines()
+    {
+        for (auto it = m_deadlines.begin(); it != m_deadlines.end(); )
+        {
+            if (!has_key(m_resolving, it->first) && !has_key(m_looking_up, it->first))
+                it = m_deadlines.erase(it);
+            else
+                it++;
+        }
+    }
+    
+    static bool has_key(const std::list<bonjour_service>& list, const std::string& key)
+    {
+        for (auto it = list.begin(); it != list.end(); it++)
+            if (deadline_key(*it) == key)
+                return true;
+        
+        return false;
+    }
+    
+    void copy_peers(std::list<bonjour_service>& peers)
+    {
+        if (!m_options.m_skip_draining)
+        {
+            peers = m_peers;
+            return;
+        }
+        
+        peers.clear();
+        
+        for (auto it = m_peers.begin(); it != m_peers.end(); it++)
+            if (!it->draining())
+                peers.push_back(*it);
+    }
+    
+    void fail(std::list<bonjour_service>& list, std::list<bonjour_service>::iterator it)
+    {
+        m_deadlines.erase(deadline_key(*it));
+        m_retry.emplace_back(it->name(), it->regtype(), it->domain());
+        list.erase(it);
+    }
+    
+    template <class T>
+    static void prune(std::list<T>& list, std::list<bonjour_named>& services)
+    {
+        for (auto it = list.begin(); it != list.end(); )
+        {
+            if (it->find(services) == services.end())
+                it = list.erase(it);
+            else
+                it++;
+        }
+    }
+    
+    // The service of this peer follows the name it is registered under (so it changes after a conflict rename)
+    // N.B. Copies of the (lazy) service share its resolution
+    
+    bonjour_service this_service() const
+    {
+        auto self = registered_self();
+        
+        mutex_lock lock(m_mutex);
+        
+        if (!self.equal(m_this_service))
+        {
+            m_this_service = bonjour_service(self, bonjour_service::notify_type(), true);
+            
+            if (advertises())
+                m_this_service.resolve();
+        }
+        
+        return m_this_service;
+    }
+    
+    // This peer as registered (the daemon may have renamed it after a conflict)
+    
+    bonjour_named registered_self() const
+    {
+        auto name = m_register.registered_name();
+        
+        return bonjour_named(name.empty() ? m_register.name() : name.c_str(), m_register.regtype(), m_register.domain());
+    }
+    
     bonjour_peer_options m_options;
     
     bonjour_register m_register;
     bonjour_browse m_browse;
-    bonjour_service m_this_service;
+    mutable bonjour_service m_this_service;
     
-    mutable std::mutex m_mutex;
+    using mutex_type = impl::profiled<bonjour_policy::internal_mutex_type>;
+    using mutex_lock = std::unique_lock<mutex_type>;
+    
+    mutable mutex_type m_mutex;
     std::list<bonjour_service> m_peers;
+    
+    // Pipeline stages
+    
+    std::list<bonjour_named> m_resolve_queue;
+    std::list<bonjour_named> m_retry;
+    std::list<bonjour_service> m_resolving;
+    std::list<bonjour_service> m_lookup_queue;
+    std::list<bonjour_service> m_looking_up;
+    std::unordered_map<std::string, bonjour_clock::time_point> m_deadlines;
+    
+    bonjour_clock::time_point m_next_drain_check = bonjour_clock::now();
+    size_t m_draining_peers = 0;
+    
+    std::shared_ptr<impl::change_signal> m_signal;
+    std::shared_ptr<impl::change_signal> m_observer;
+    impl::change_signal m_peers_signal;
+    std::atomic<bool> m_running;
+    std::thread m_pipeline;
 };
 
 #endif /* BONJOUR_PEER_HPP */
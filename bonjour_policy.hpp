@@ -0,0 +1,66 @@
+
+#ifndef BONJOUR_POLICY_HPP
+#define BONJOUR_POLICY_HPP
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+
+// A mutex that does nothing (for objects only ever used from a single thread)
+
+struct bonjour_null_mutex
+{
+    void lock() {}
+    void unlock() {}
+    bool try_lock() { return true; }
+};
+
+// A condition that does nothing (with no other threads nothing can change during a wait, so waits only check)
+
+struct bonjour_null_condition
+{
+    void notify_one() {}
+    void notify_all() {}
+    
+    template <class L, class P>
+    void wait(L&, P) {}
+    
+    template <class L, class T, class P>
+    bool wait_until(L&, const T&, P predicate) { return predicate(); }
+};
+
+// A policy supplies the locks of objects, the locks and conditions of internal registries and signals
+// It also supplies the container used for the service lists of browses
+
+// The default policy (replies are processed on a thread per operation and all state is locked)
+
+struct bonjour_threaded_policy
+{
+    static constexpr bool threaded = true;
+    
+    using mutex_type = std::recursive_mutex;
+    using internal_mutex_type = std::mutex;
+    using condition_type = std::condition_variable_any;
+    
+    template <class T>
+    using container_type = std::list<T>;
+};
+
+// A policy for driving everything from one event loop thread (without any threads or locking)
+// Replies are processed by calling process() on each object whenever its socket() is readable
+// Blocking waits return immediately (as nothing can change whilst they wait), so should not be used
+// Features that need their own threads (auto-resolve and hold-down expiry timers) are disabled
+
+struct bonjour_single_thread_policy
+{
+    static constexpr bool threaded = false;
+    
+    using mutex_type = bonjour_null_mutex;
+    using internal_mutex_type = bonjour_null_mutex;
+    using condition_type = bonjour_null_condition;
+    
+    template <class T>
+    using container_type = std::list<T>;
+};
+
+#endif /* BONJOUR_POLICY_HPP */
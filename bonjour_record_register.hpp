@@ -0,0 +1,235 @@
+
+#ifndef BONJOUR_RECORD_REGISTER_HPP
+#define BONJOUR_RECORD_REGISTER_HPP
+
+#include "bonjour_named.hpp"
+
+#include <cstring>
+#include <string>
+
+namespace impl
+{
+    // Converts an escaped domain name (as made by DNSServiceConstructFullName) to wire format
+    
+    inline bool encode_domain(const char *name, std::string& wire)
+    {
+        std::string label;
+        
+        for (const char *c = name; ; c++)
+        {
+            if (!*c || *c == '.')
+            {
+                if (label.length() > 63)
+                    return false;
+                
+                if (!label.empty())
+                {
+                    wire += static_cast<char>(label.length());
+                    wire += label;
+                    label.clear();
+                }
+                
+                if (!*c)
+                    break;
+            }
+            else if (*c == '\\' && is_digit(c[1]) && is_digit(c[2]) && is_digit(c[3]))
+            {
+                label += static_cast<char>((c[1] - '0') * 100 + (c[2] - '0') * 10 + (c[3] - '0'));
+                c += 3;
+            }
+            else if (*c == '\\' && c[1])
+                label += *++c;
+            else
+                label += *c;
+        }
+        
+        wire += '\0';
+        
+        return wire.length() <= 255;
+    }
+}
+
+// Options for bonjour_record_register
+
+struct bonjour_record_options
+{
+    // The TTL in seconds of the PTR, SRV and TXT records (the daemon defaults are 4500, 120 and 4500)
+    
+    uint32_t m_ttl = 10;
+    
+    // The target host of the SRV record (required, for example "myhost.local.")
+    // N.B. The daemon only answers for the addresses of its own LocalHostName (which may differ from gethostname())
+    // N.B. Any other host needs its own address records for the service to be resolvable
+    
+    std::string m_host;
+};
+
+// An object for registering a named bonjour service as individual records with a custom TTL
+// Short TTLs mean that browsers drop a peer that disappears without saying goodbye much sooner
+// Unlike bonjour_register the name is never changed on conflict (errors report kDNSServiceErr_NameConflict)
+// Starting fails with kDNSServiceErr_BadParam if no target host is given in the options
+// N.B. The Avahi compatibility layer does not implement DNSServiceRegisterRecord (so this cannot start there)
+
+class bonjour_record_register : public bonjour_named
+{
+public:
+    
+    static DNSServiceErrorType service(DNSServiceRef *sd_ref,
+                                       DNSServiceFlags flags,
+                                       uint32_t interface,
+                                       bonjour_record_register *object,
+                                       DNSServiceRegisterRecordReply reply,
+                                       void *context)
+    {
+        auto err = DNSServiceCreateConnection(sd_ref);
+        
+        if (err == kDNSServiceErr_NoError)
+            err = object->register_records(*sd_ref, flags, interface, reply, context);
+        
+        if (err != kDNSServiceErr_NoError && *sd_ref)
+        {
+            DNSServiceRefDeallocate(*sd_ref);
+            *sd_ref = nullptr;
+        }
+        
+        return err;
+    }
+    
+    using callback = DNSServiceRegisterRecordReply;
+    using callback_type = make_callback_type<bonjour_record_register, 3, 1, 2>;
+    
+    friend callback_type;
+    
+    struct notify_type
+    {
+        notify_type() : m_stop(nullptr), m_add(nullptr) {}
+        
+        bonjour_notify<bonjour_record_register>::stop_type m_stop = nullptr;
+        bonjour_notify<bonjour_record_register>::state_type m_add = nullptr;
+        
+        bonjour_executor m_executor;
+    };
+    
+    bonjour_record_register(const char *name,
+                            const char *regtype,
+                            const char *domain,
+                            uint16_t port,
+                            notify_type notify = notify_type(),
+                            bonjour_record_options options = bonjour_record_options())
+    : bonjour_named(name, regtype, domain)
+    , m_port(port)
+    , m_options(options)
+    , m_registered(0)
+    , m_notify(notify)
+    {
+        impl::set_lock_class(m_mutex, "bonjour_record_register");
+        set_executor(notify.m_executor);
+    }
+    
+    ~bonjour_record_register()
+    {
+        stop();
+        end_notifications();
+    }
+    
+    bonjour_record_register(bonjour_record_register const& rhs) = delete;
+    bonjour_record_register(bonjour_record_register const&& rhs) = delete;
+    void operator = (bonjour_record_register const& rhs) = delete;
+    void operator = (bonjour_record_register const&& rhs) = delete;
+    
+    bool start()
+    {
+        return spawn(this, this);
+    }
+    
+    uint16_t port() const
+    {
+        return m_port;
+    }
+    
+    uint32_t ttl() const
+    {
+        return m_options.m_ttl;
+    }
+    
+    // True once the daemon has confirmed every record
+    
+    bool registered() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_registered == num_records;
+    }
+    
+private:
+    
+    static constexpr int num_records = 3;
+    
+    DNSServiceErrorType register_records(DNSServiceRef sd_ref,
+                                         DNSServiceFlags flags,
+                                         uint32_t interface,
+                                         DNSServiceRegisterRecordReply reply,
+                                         void *context)
+    {
+        char fullname[kDNSServiceMaxDomainName];
+        
+        // Subtypes are not supported, so only the main type is used
+        
+        std::string type(regtype(), strcspn(regtype(), ","));
+        std::string ptr, srv, target;
+        std::string txt(1, '\0');
+        
+        if (m_options.m_host.empty() || DNSServiceConstructFullName(fullname, name(), type.c_str(), domain()))
+            return kDNSServiceErr_BadParam;
+        
+        if (type.back() != '.')
+            type += '.';
+        
+        type += domain();
+        
+        // The SRV data is the priority, weight and port (left in network order) followed by the target
+        
+        srv.assign(4, '\0');
+        srv.append(reinterpret_cast<const char *>(&m_port), sizeof(m_port));
+        
+        if (!impl::encode_domain(fullname, ptr) || !impl::encode_domain(m_options.m_host.c_str(), target))
+            return kDNSServiceErr_BadParam;
+        
+        srv += target;
+        
+        m_registered = 0;
+        
+        auto err = DNSServiceRegisterRecord(sd_ref, &m_records[0], flags | kDNSServiceFlagsShared, interface,
+                                            type.c_str(), kDNSServiceType_PTR, kDNSServiceClass_IN,
+                                            ptr.length(), ptr.data(), m_options.m_ttl, reply, context);
+        
+        if (err == kDNSServiceErr_NoError)
+            err = DNSServiceRegisterRecord(sd_ref, &m_records[1], flags | kDNSServiceFlagsUnique, interface,
+                                           fullname, kDNSServiceType_SRV, kDNSServiceClass_IN,
+                                           srv.length(), srv.data(), m_options.m_ttl, reply, context);
+        
+        if (err == kDNSServiceErr_NoError)
+            err = DNSServiceRegisterRecord(sd_ref, &m_records[2], flags | kDNSServiceFlagsUnique, interface,
+                                           fullname, kDNSServiceType_TXT, kDNSServiceClass_IN,
+                                           txt.length(), txt.data(), m_options.m_ttl, reply, context);
+        
+        return err;
+    }
+    
+    void reply(DNSRecordRef, DNSServiceFlags flags)
+    {
+        bool complete = (flags & kDNSServiceFlagsMoreComing) == 0;
+        
+        if (++m_registered == num_records)
+            notify(bonjour_callback::add, m_notify.m_add, this, name(), regtype(), domain(), complete);
+    }
+    
+    uint16_t m_port;
+    bonjour_record_options m_options;
+    
+    DNSRecordRef m_records[num_records];
+    int m_registered;
+    
+    notify_type m_notify;
+};
+
+#endif /* BONJOUR_RECORD_REGISTER_HPP */
@@ -3,8 +3,29 @@
 #define BONJOUR_REGISTER_HPP
 
 #include "bonjour_named.hpp"
+#include "bonjour_timer.hpp"
+#include "bonjour_txt.hpp"
+
+// Options for bonjour_register
+
+struct bonjour_register_options
+{
+    // Names can be made unique up front (avoiding conflicts when many similar nodes register at once)
+    // append_host adds the host name and append_id adds m_unique_id (for example "name (host)")
+    
+    enum class naming { as_given, append_host, append_id };
+    
+    naming m_naming = naming::as_given;
+    std::string m_unique_id;
+    
+    // Without auto-rename a conflict stops the registration (and error() reports kDNSServiceErr_NameConflict)
+    
+    bool m_auto_rename = true;
+};
 
 // An object for registering a named bonjour service
+// The registered name may differ from the requested one if the daemon renames the service after a conflict
+// Draining advertises that the service is going away (via its TXT record) before it is deregistered
 
 class bonjour_register : public bonjour_named
 {
@@ -19,31 +40,183 @@ public:
     
     struct notify_type
     {
-        notify_type() : m_stop(nullptr), m_add(nullptr), m_remove(nullptr) {}
+        notify_type() : m_stop(nullptr), m_add(nullptr), m_remove(nullptr), m_drained(nullptr) {}
 
         bonjour_notify<bonjour_register>::stop_type m_stop = nullptr;
         bonjour_notify<bonjour_register>::state_type m_add = nullptr;
         bonjour_notify<bonjour_register>::state_type m_remove = nullptr;
+        bonjour_notify<bonjour_register>::stop_type m_drained = nullptr;
+        
+        bonjour_executor m_executor;
     };
     
     bonjour_register(const char *name,
                      const char *regtype,
                      const char *domain,
                      uint16_t port,
-                     notify_type notify = notify_type())
-    : bonjour_named(name, regtype, domain)
+                     notify_type notify = notify_type(),
+                     bonjour_register_options options = bonjour_register_options())
+    : bonjour_named(unique_name(name, options).c_str(), regtype, domain)
     , m_port(port)
+    , m_auto_rename(options.m_auto_rename)
+    , m_registered(false)
+    , m_drain_timer(0)
+    , m_draining(false)
+    , m_closing(false)
     , m_notify(notify)
-    {}
+    {
+        impl::set_lock_class(m_mutex, "bonjour_register");
+        set_executor(notify.m_executor);
+    }
+    
+    bonjour_register(const char *name,
+                     impl::static_regtype regtype,
+                     const char *domain,
+                     uint16_t port,
+                     notify_type notify = notify_type(),
+                     bonjour_register_options options = bonjour_register_options())
+    : bonjour_named(unique_name(name, options).c_str(), regtype, domain)
+    , m_port(port)
+    , m_auto_rename(options.m_auto_rename)
+    , m_registered(false)
+    , m_drain_timer(0)
+    , m_draining(false)
+    , m_closing(false)
+    , m_notify(notify)
+    {
+        impl::set_lock_class(m_mutex, "bonjour_register");
+        set_executor(notify.m_executor);
+    }
+    
+    ~bonjour_register()
+    {
+        {
+            mutex_lock lock(m_mutex);
+            m_closing = true;
+        }
+        
+        stop();
+        end_notifications();
+    }
     
     bonjour_register(bonjour_register const& rhs) = delete;
     bonjour_register(bonjour_register const&& rhs) = delete;
     void operator = (bonjour_register const& rhs) = delete;
     void operator = (bonjour_register const&& rhs) = delete;
     
+    // Starting clears any previous drain
+    
     bool start()
     {
-        return spawn(this, name(), regtype(), domain(), nullptr, m_port, 0, nullptr);
+        bonjour_txt txt;
+        
+        if (!active())
+            cancel_drain();
+        
+        {
+            mutex_lock lock(m_mutex);
+            
+            if (!active())
+            {
+                m_registered = false;
+                m_registered_name.clear();
+                m_start_time = bonjour_clock::now();
+                m_draining = false;
+                m_txt.remove(bonjour_txt::draining_key());
+            }
+            
+            txt = m_txt;
+        }
+        
+        DNSServiceFlags flags = m_auto_rename ? 0 : kDNSServiceFlagsNoAutoRename;
+        
+        return spawn_flags(flags, this, name(), regtype(), domain(), nullptr, m_port, txt.length(), txt.data());
+    }
+    
+    // Stopping cancels any pending drain
+    
+    void stop()
+    {
+        cancel_drain();
+        bonjour_base::stop();
+    }
+    
+    // The TXT record is updated in place if the service is already registered
+    // N.B. A draining service keeps its draining key (so peers do not pick it again)
+    
+    bool set_txt(const bonjour_txt& txt)
+    {
+        {
+            mutex_lock lock(m_mutex);
+            m_txt = txt;
+            
+            if (m_draining)
+                m_txt.set(bonjour_txt::draining_key());
+        }
+        
+        return !active() || update_txt();
+    }
+    
+    // Sets the TXT record from raw data (without allocating if the record is no larger than before)
+    // N.B. Whilst draining the stored record (with the draining key added) is sent instead
+    
+    bool set_txt(const void *data, uint16_t length)
+    {
+        bool draining;
+        
+        {
+            mutex_lock lock(m_mutex);
+            m_txt.assign(data, length);
+            draining = m_draining;
+            
+            if (draining)
+                m_txt.set(bonjour_txt::draining_key());
+        }
+        
+        if (draining)
+            return !active() || update_txt();
+        
+        return !active() || update_record(nullptr, data, length) == kDNSServiceErr_NoError;
+    }
+    
+    bonjour_txt txt() const
+    {
+        mutex_lock lock(m_mutex);
+        bonjour_txt txt(m_txt);
+        return txt;
+    }
+    
+    // Sets the draining key and deregisters after the given time in seconds (notifying when drained)
+    // With no time the service is left draining until it is stopped
+    // N.B. The drained notification means that deregistration has been requested (goodbyes may still be in flight)
+    
+    bool drain(double seconds = 0.0)
+    {
+        {
+            mutex_lock lock(m_mutex);
+            
+            if (!active() || m_draining)
+                return false;
+            
+            m_draining = true;
+            m_txt.set(bonjour_txt::draining_key());
+        }
+        
+        if (!update_txt())
+            return false;
+        
+        mutex_lock lock(m_mutex);
+        
+        if (seconds > 0.0 && !m_closing && !m_drain_timer)
+            m_drain_timer = bonjour_timers::shared().schedule(seconds, [this](){ drained(); });
+        
+        return true;
+    }
+    
+    bool draining() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_draining;
     }
     
     uint16_t port() const
@@ -51,19 +224,153 @@ public:
         return m_port;
     }
     
+    // The name actually registered (empty until registration completes)
+    
+    std::string registered_name() const
+    {
+        mutex_lock lock(m_mutex);
+        std::string str(m_registered_name);
+        return str;
+    }
+    
+    bool registered() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_registered;
+    }
+    
+    bool renamed() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_registered && m_registered_name != name();
+    }
+    
+    bool conflicted() const
+    {
+        return error() == kDNSServiceErr_NameConflict;
+    }
+    
+    // The time in seconds from start() until the registration completed (including probing and any renames)
+    
+    double registration_time() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_registered ? std::chrono::duration<double>(m_registered_time - m_start_time).count() : 0.0;
+    }
+    
 private:
     
+    bool update_txt()
+    {
+        bonjour_txt txt = this->txt();
+        
+        return update_record(nullptr, txt.data(), txt.length()) == kDNSServiceErr_NoError;
+    }
+    
+    // N.B. The timer is only cleared once this has finished (so that stopping on another thread waits for it)
+    
+    void drained()
+    {
+        bonjour_timers::timer_id timer;
+        
+        {
+            mutex_lock lock(m_mutex);
+            timer = m_drain_timer;
+        }
+        
+        bonjour_base::stop();
+        notify(bonjour_callback::drained, m_notify.m_drained, this);
+        
+        mutex_lock lock(m_mutex);
+        
+        if (m_drain_timer == timer)
+            m_drain_timer = 0;
+    }
+    
+    void cancel_drain()
+    {
+        bonjour_timers::timer_id timer;
+        
+        {
+            mutex_lock lock(m_mutex);
+            timer = m_drain_timer;
+            m_drain_timer = 0;
+        }
+        
+        // N.B. Don't hold the lock whilst cancelling as the timer may be waiting on it
+        
+        if (timer)
+            bonjour_timers::shared().cancel(timer);
+    }
+    
     void reply(DNSServiceFlags flags, const char *name, const char *regtype, const char *domain)
     {
         bool complete = (flags & kDNSServiceFlagsMoreComing) == 0;
         
         if (flags & kDNSServiceFlagsAdd)
-            notify(m_notify.m_add, this, name, regtype, domain, complete);
+        {
+            if (!m_registered)
+                m_registered_time = bonjour_clock::now();
+            
+            m_registered = true;
+            m_registered_name = name;
+            
+            notify(bonjour_callback::add, m_notify.m_add, this, name, regtype, domain, complete);
+        }
         else
-            notify(m_notify.m_remove, this, name, regtype, domain, complete);
+            notify(bonjour_callback::remove, m_notify.m_remove, this, name, regtype, domain, complete);
+    }
+    
+    // Names are limited to a single DNS label (so the requested name is shortened to fit any suffix)
+    
+    static std::string unique_name(const char *name, const bonjour_register_options& options)
+    {
+        constexpr size_t max_length = 63;
+        
+        std::string str(name ? name : "");
+        std::string suffix;
+        
+        switch (options.m_naming)
+        {
+            case bonjour_register_options::naming::as_given:
+                return str;
+                
+            case bonjour_register_options::naming::append_host:
+                suffix = impl::host_label();
+                break;
+                
+            case bonjour_register_options::naming::append_id:
+                suffix = options.m_unique_id;
+                break;
+        }
+        
+        if (suffix.empty())
+            return str;
+        
+        suffix = " (" + suffix.substr(0, max_length / 2) + ")";
+        
+        size_t length = std::min(str.length(), max_length - suffix.length());
+        
+        // Don't split a UTF-8 character
+        
+        while (length && length < str.length() && (str[length] & 0xC0) == 0x80)
+            length--;
+        
+        return str.substr(0, length) + suffix;
     }
     
     uint16_t m_port;
+    bool m_auto_rename;
+    
+    bool m_registered;
+    std::string m_registered_name;
+    bonjour_clock::time_point m_start_time;
+    bonjour_clock::time_point m_registered_time;
+    
+    bonjour_txt m_txt;
+    bonjour_timers::timer_id m_drain_timer;
+    bool m_draining;
+    bool m_closing;
 
     notify_type m_notify;
 };
@@ -0,0 +1,237 @@
+
+#ifndef BONJOUR_SCHEDULER_HPP
+#define BONJOUR_SCHEDULER_HPP
+
+#include "bonjour_browse.hpp"
+#include "bonjour_peer.hpp"
+#include "bonjour_timer.hpp"
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <random>
+
+// Options for bonjour_scheduler
+
+struct bonjour_scheduler_options
+{
+    // Each start is delayed by a random time of up to m_jitter seconds
+    
+    double m_jitter = 1.0;
+    
+    // Starts are spaced so that there are no more than m_rate per second (zero for no limit)
+    
+    double m_rate = 20.0;
+};
+
+// Statistics for a bonjour_scheduler (times are in seconds)
+
+struct bonjour_scheduler_stats
+{
+    size_t m_scheduled = 0;
+    size_t m_started = 0;
+    size_t m_failed = 0;
+    
+    double m_spread = 0.0;
+    double m_max_delay = 0.0;
+};
+
+// An object for spreading out the starts of registrations, browses and peers (to avoid bursts of traffic)
+// Starts run on the timer thread, so objects must outlive their start (or be cancelled first)
+
+class bonjour_scheduler
+{
+    struct entry
+    {
+        const void *m_object;
+        uint64_t m_key;
+        bonjour_timers::timer_id m_timer;
+    };
+    
+public:
+    
+    // A scheduler shared by the whole process (so that the rate limit applies to all starts)
+    
+    static bonjour_scheduler& shared()
+    {
+        static bonjour_scheduler scheduler;
+        return scheduler;
+    }
+    
+    bonjour_scheduler(bonjour_scheduler_options options = bonjour_scheduler_options())
+    : m_options(options)
+    , m_random(std::random_device()())
+    , m_last_key(0)
+    {
+        // N.B. Make sure the timers outlive any scheduler with static storage
+        
+        bonjour_timers::shared();
+    }
+    
+    ~bonjour_scheduler()
+    {
+        std::list<entry> pending;
+        
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::swap(pending, m_pending);
+        }
+        
+        for (auto it = pending.begin(); it != pending.end(); it++)
+            bonjour_timers::shared().cancel(it->m_timer);
+    }
+    
+    bonjour_scheduler(bonjour_scheduler const& rhs) = delete;
+    void operator = (bonjour_scheduler const& rhs) = delete;
+    
+    void set_options(bonjour_scheduler_options options)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_options = options;
+    }
+    
+    // Schedules a call to start() on the object
+    
+    template <class T>
+    void start(T& object)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        auto now = bonjour_clock::now();
+        auto when = now;
+        auto key = ++m_last_key;
+        
+        if (m_options.m_jitter > 0.0)
+            when += to_duration(std::uniform_real_distribution<double>(0.0, m_options.m_jitter)(m_random));
+        
+        if (m_options.m_rate > 0.0)
+        {
+            when = std::max(when, m_next_slot);
+            m_next_slot = when + to_duration(1.0 / m_options.m_rate);
+        }
+        
+        if (!m_stats.m_scheduled++)
+            m_first_scheduled = now;
+        
+        auto callback = [this, &object, key, now]()
+        {
+            bool started = object.start();
+            completed(key, now, started);
+        };
+        
+        m_pending.push_back(entry{ &object, key, bonjour_timers::shared().schedule(when, callback) });
+    }
+    
+    // Returns false if the object had no pending start (if the start is running this waits for it)
+    
+    template <class T>
+    bool cancel(T& object)
+    {
+        std::list<entry> cancelled;
+        
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            
+            for (auto it = m_pending.begin(); it != m_pending.end(); )
+            {
+                auto jt = it++;
+                
+                if (jt->m_object == &object)
+                    cancelled.splice(cancelled.end(), m_pending, jt);
+            }
+        }
+        
+        // N.B. Don't hold the lock whilst cancelling as a running start may be waiting on it
+        
+        for (auto it = cancelled.begin(); it != cancelled.end(); it++)
+            bonjour_timers::shared().cancel(it->m_timer);
+        
+        return !cancelled.empty();
+    }
+    
+    size_t pending() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_pending.size();
+    }
+    
+    bonjour_scheduler_stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+    
+    void reset_stats()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats = bonjour_scheduler_stats();
+    }
+    
+    // Convergence is measured from the first scheduled start (returning a negative time if the deadline passes first)
+    
+    double wait_for_convergence(bonjour_browse& browse, size_t count, bonjour_clock::time_point deadline)
+    {
+        return browse.wait_for_services(count, deadline) ? since_first() : -1.0;
+    }
+    
+    double wait_for_convergence(bonjour_peer& peer, size_t count, bonjour_clock::time_point deadline)
+    {
+        return peer.wait_for_peers(count, deadline) ? since_first() : -1.0;
+    }
+    
+private:
+    
+    static bonjour_clock::duration to_duration(double seconds)
+    {
+        return std::chrono::duration_cast<bonjour_clock::duration>(std::chrono::duration<double>(seconds));
+    }
+    
+    static double seconds(bonjour_clock::duration duration)
+    {
+        return std::chrono::duration<double>(duration).count();
+    }
+    
+    double since_first() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return seconds(bonjour_clock::now() - m_first_scheduled);
+    }
+    
+    void completed(uint64_t key, bonjour_clock::time_point scheduled, bool started)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        auto now = bonjour_clock::now();
+        
+        for (auto it = m_pending.begin(); it != m_pending.end(); it++)
+        {
+            if (it->m_key == key)
+            {
+                m_pending.erase(it);
+                break;
+            }
+        }
+        
+        if (started)
+            m_stats.m_started++;
+        else
+            m_stats.m_failed++;
+        
+        m_stats.m_spread = std::max(m_stats.m_spread, seconds(now - m_first_scheduled));
+        m_stats.m_max_delay = std::max(m_stats.m_max_delay, seconds(now - scheduled));
+    }
+    
+    mutable std::mutex m_mutex;
+    
+    bonjour_scheduler_options m_options;
+    bonjour_scheduler_stats m_stats;
+    
+    std::mt19937 m_random;
+    bonjour_clock::time_point m_next_slot;
+    bonjour_clock::time_point m_first_scheduled;
+    
+    uint64_t m_last_key;
+    std::list<entry> m_pending;
+};
+
+#endif /* BONJOUR_SCHEDULER_HPP */
@@ -2,10 +2,22 @@
 #ifndef BONJOUR_SERVICE_HPP
 #define BONJOUR_SERVICE_HPP
 
+#include "bonjour_address.hpp"
 #include "bonjour_named.hpp"
+#include "bonjour_txt.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
 
 // An object for resolving a named bonjour service
 // This can be constructed from separate names, or a bonjour_named object
+// Once resolved the address of the host can also be looked up
+// Lazy services only resolve when first resolved, waited on or asked for their host or port
+// Copies of a lazy service share the same resolution (and notifications are made for the shared resolver)
+// Concurrent resolves of the same service share a single operation, with the result passed to every waiter
+// Monitored services keep resolving (so that changes to the TXT record are seen) and never share a resolve
 
 class bonjour_service : public bonjour_named
 {
@@ -14,7 +26,7 @@ public:
     static constexpr auto service = DNSServiceResolve;
     
     using callback = DNSServiceResolveReply;
-    using callback_type = make_callback_type<bonjour_service, 3, 1, 4, 5, 6>;
+    using callback_type = make_callback_type<bonjour_service, 3, 1, 4, 5, 6, 7, 8>;
     
     friend callback_type;
     
@@ -24,17 +36,41 @@ public:
 
         bonjour_notify<bonjour_service>::stop_type m_stop = nullptr;
         bonjour_notify<bonjour_service>::resolve_type m_resolve = nullptr;
+        
+        bonjour_executor m_executor;
     };
     
-    bonjour_service(bonjour_named named, notify_type notify = notify_type())
+    bonjour_service(bonjour_named named, notify_type notify = notify_type(), bool lazy = false, bool monitor = false)
     : bonjour_named(named)
     , m_port(0)
+    , m_resolved(false)
+    , m_draining(false)
+    , m_monitor(monitor)
+    , m_lazy(lazy ? std::make_shared<lazy_resolver>() : nullptr)
     , m_notify(notify)
     {
-        if (strlen(name()))
+        impl::set_lock_class(m_mutex, "bonjour_service");
+        set_executor(notify.m_executor);
+        
+        if (strlen(name()) && !lazy)
             resolve();
     }
     
+    // A service that is already resolved (for example, as reported by another process)
+    
+    bonjour_service(bonjour_named named, const char *fullname, const char *host, uint16_t port, const char *address)
+    : bonjour_named(named)
+    , m_fullname(fullname)
+    , m_host(host)
+    , m_port(port)
+    , m_address(address)
+    , m_resolved(true)
+    , m_draining(false)
+    , m_monitor(false)
+    {
+        impl::set_lock_class(m_mutex, "bonjour_service");
+    }
+    
     bonjour_service(const char *name, const char *regtype, const char *domain, notify_type notify = notify_type())
     : bonjour_service(bonjour_named(name, regtype, domain), notify)
     {}
@@ -42,31 +78,192 @@ public:
     bonjour_service(bonjour_service const& rhs)
     : bonjour_named("", "", "")
     {
+        impl::set_lock_class(m_mutex, "bonjour_service");
         *this = rhs;
     }
     
+    // N.B. The thread is stopped before leaving so that no reply can arrive once the resolve has been handed over
+    
+    ~bonjour_service()
+    {
+        bonjour_base::stop();
+        end_notifications();
+        leave();
+    }
+    
     void operator = (bonjour_service const& rhs)
     {
+        // N.B. Don't hold the lock whilst stopping the lookup or leaving a resolve as that can cause deadlocks
+        
+        reset_lookup(nullptr);
+        bonjour_base::stop();
+        leave();
+        
         mutex_lock lock1(m_mutex);
         mutex_lock lock2(rhs.m_mutex);
             
-        stop();
+        bonjour_base::stop();
         
         static_cast<bonjour_named&>(*this) = static_cast<const bonjour_named&>(rhs);
         
         m_fullname = rhs.m_fullname;
         m_host = rhs.m_host;
         m_port = rhs.m_port;
+        m_address = rhs.m_address;
+        m_resolved = rhs.m_resolved;
+        m_txt = rhs.m_txt;
+        m_draining = rhs.m_draining;
+        m_monitor = rhs.m_monitor;
+        m_lazy = rhs.m_lazy;
         m_notify = rhs.m_notify;
+        
+        set_executor(m_notify.m_executor);
     }
     
     bool resolve()
     {
-        return spawn(this, name(), regtype(), domain());
+        if (m_lazy)
+            return lazy_service()->resolved() || lazy_service()->resolve();
+        
+        if (m_monitor)
+            return spawn(this, name(), regtype(), domain());
+        
+        // Join any resolve of the same service that is already in flight, or else lead a new one
+        
+        {
+            auto& registry = flights();
+            registry_lock lock(registry.m_mutex);
+            
+            auto it = find(registry.m_flights);
+            
+            if (it != registry.m_flights.end())
+            {
+                auto& waiters = it->m_waiters;
+                
+                if (it->m_leader != this && std::find(waiters.begin(), waiters.end(), this) == waiters.end())
+                    waiters.push_back(this);
+                
+                return true;
+            }
+            
+            registry.m_flights.emplace_back(*this, this);
+        }
+        
+        if (spawn(this, name(), regtype(), domain()))
+            return true;
+        
+        leave();
+        return false;
+    }
+    
+    // True whilst resolving (either directly or by waiting on another resolve of the same service)
+    
+    bool resolving() const
+    {
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service && service->resolving();
+        }
+        
+        if (active())
+            return true;
+        
+        auto& registry = flights();
+        registry_lock lock(registry.m_mutex);
+        
+        for (auto it = registry.m_flights.begin(); it != registry.m_flights.end(); it++)
+        {
+            auto& waiters = it->m_waiters;
+            
+            if (it->m_leader == this || std::find(waiters.begin(), waiters.end(), this) != waiters.end())
+                return true;
+        }
+        
+        return false;
+    }
+    
+    // Stopping a resolve hands it over to any other services waiting on it (and wakes anything waiting for it)
+    
+    void stop()
+    {
+        bonjour_base::stop();
+        leave();
+        m_signal.notify();
+    }
+    
+    bool resolved() const
+    {
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service && service->resolved();
+        }
+        
+        mutex_lock lock(m_mutex);
+        return m_resolved;
+    }
+    
+    // Blocks until the service is resolved (returning false if the resolve fails or the deadline passes first)
+    
+    bool wait_for_resolve(bonjour_clock::time_point deadline) const
+    {
+        if (m_lazy)
+            return lazy_service()->wait_for_resolve(deadline);
+        
+        while (true)
+        {
+            auto generation = m_signal.generation();
+            
+            if (resolved())
+                return true;
+            
+            if (!resolving() || !m_signal.wait_for_change(generation, deadline))
+                return false;
+        }
+    }
+    
+    // Looks up the address of the resolved host (any observer of this object is also notified)
+    
+    bool lookup()
+    {
+        if (m_lazy)
+            return lazy_service()->lookup();
+        
+        std::string host(this->host());
+        
+        if (host.empty())
+            return false;
+        
+        auto lookup = std::make_shared<address_lookup>(this, host.c_str());
+        
+        lookup->observe(observer());
+        reset_lookup(lookup);
+        
+        return lookup->lookup();
+    }
+    
+    bool looking_up() const
+    {
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service && service->looking_up();
+        }
+        
+        auto lookup = current_lookup();
+        
+        return lookup && lookup->active();
     }
     
     std::string fullname() const
     {
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service ? service->fullname() : std::string();
+        }
+        
         mutex_lock lock(m_mutex);
         std::string str(m_fullname);
         return str;
@@ -74,6 +271,9 @@ public:
     
     std::string host() const
     {
+        if (m_lazy)
+            return lazy_service()->host();
+        
         mutex_lock lock(m_mutex);
         std::string str(m_host);
         return str;
@@ -81,29 +281,474 @@ public:
     
     uint16_t port() const
     {
+        if (m_lazy)
+            return lazy_service()->port();
+        
         mutex_lock lock(m_mutex);
         uint16_t port = m_port;
         return port;
     }
     
+    // Accessors that wait for resolution (accessing a lazy service starts the resolve)
+    
+    std::string host(bonjour_clock::time_point deadline) const
+    {
+        wait_for_resolve(deadline);
+        return host();
+    }
+    
+    uint16_t port(bonjour_clock::time_point deadline) const
+    {
+        wait_for_resolve(deadline);
+        return port();
+    }
+    
+    std::string address() const
+    {
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service ? service->address() : std::string();
+        }
+        
+        mutex_lock lock(m_mutex);
+        std::string str(m_address);
+        return str;
+    }
+    
+    bonjour_txt txt() const
+    {
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service ? service->txt() : bonjour_txt();
+        }
+        
+        mutex_lock lock(m_mutex);
+        bonjour_txt txt(m_txt);
+        return txt;
+    }
+    
+    // Without threads the socket and processing of a lazy service are those of its resolver
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    int socket() const
+    {
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service ? service->socket<P>() : -1;
+        }
+        
+        return bonjour_base::socket<P>();
+    }
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    bool process()
+    {
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service && service->process<P>();
+        }
+        
+        return bonjour_base::process<P>();
+    }
+    
+    // Adds the sockets of the resolve and of any address lookup (the lookup has a socket of its own)
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    void sockets(std::vector<int>& sockets) const
+    {
+        if (m_lazy)
+        {
+            if (auto service = lazy_started())
+                service->sockets<P>(sockets);
+            
+            return;
+        }
+        
+        auto lookup = current_lookup();
+        
+        if (bonjour_base::socket<P>() >= 0)
+            sockets.push_back(bonjour_base::socket<P>());
+        
+        if (lookup && lookup->socket<P>() >= 0)
+            sockets.push_back(lookup->socket<P>());
+    }
+    
+    // Processes replies for a readable socket (returning false if the socket does not belong to this service)
+    
+    template <class P = bonjour_policy, std::enable_if_t<!P::threaded, bool> = true>
+    bool process(int fd)
+    {
+        if (fd < 0)
+            return false;
+        
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service && service->process<P>(fd);
+        }
+        
+        auto lookup = current_lookup();
+        
+        if (bonjour_base::socket<P>() == fd)
+            bonjour_base::process<P>();
+        else if (lookup && lookup->socket<P>() == fd)
+            lookup->process<P>();
+        else
+            return false;
+        
+        return true;
+    }
+    
+    // True if the TXT record of the service has the draining key (this is cheap to check)
+    
+    bool draining() const
+    {
+        if (m_lazy)
+        {
+            auto service = lazy_started();
+            return service && service->draining();
+        }
+        
+        mutex_lock lock(m_mutex);
+        return m_draining;
+    }
+    
 private:
     
-    void reply(DNSServiceFlags flags, const char *fullname, const char *host, uint16_t port)
+    // An address lookup that reports back to the service that owns it
+    
+    class address_lookup : public bonjour_address
+    {
+    public:
+        
+        address_lookup(bonjour_service *owner, const char *host)
+        : bonjour_address(host, make_notify())
+        , m_owner(owner)
+        {}
+        
+    private:
+        
+        static notify_type make_notify()
+        {
+            notify_type notify;
+            notify.m_address = found;
+            return notify;
+        }
+        
+        static void found(bonjour_address *object, const char *, const char *address, bool)
+        {
+            auto owner = static_cast<address_lookup *>(object)->m_owner;
+            
+            mutex_lock lock(owner->m_mutex);
+            owner->m_address = address;
+        }
+        
+        bonjour_service *m_owner;
+    };
+    
+    // A process-wide registry of resolves in flight
+    // Waiters are pinned (so they cannot leave) whilst being handed a resolve or passed its result
+    
+    struct flight : public bonjour_named
+    {
+        flight(const bonjour_named& named, bonjour_service *leader)
+        : bonjour_named(named)
+        , m_leader(leader)
+        , m_spawning(nullptr)
+        {}
+        
+        bonjour_service *m_leader;
+        std::list<bonjour_service *> m_waiters;
+        bonjour_service *m_spawning;
+    };
+    
+    struct delivery
+    {
+        std::list<bonjour_service *> m_waiters;
+        std::thread::id m_thread;
+    };
+    
+    using registry_mutex = impl::profiled<bonjour_policy::internal_mutex_type>;
+    
+    struct flight_registry
+    {
+        flight_registry()
+        {
+            impl::set_lock_class(m_mutex, "bonjour_service::flights");
+        }
+        
+        registry_mutex m_mutex;
+        bonjour_policy::condition_type m_cond;
+        std::list<flight> m_flights;
+        std::list<delivery> m_deliveries;
+    };
+    
+    using registry_lock = std::unique_lock<registry_mutex>;
+    
+    // N.B. This is never destroyed as detached threads may still be finishing at exit
+    
+    static flight_registry& flights()
+    {
+        static flight_registry *registry = new flight_registry;
+        return *registry;
+    }
+    
+    bool spawning(flight_registry& registry) const
+    {
+        for (auto it = registry.m_flights.begin(); it != registry.m_flights.end(); it++)
+            if (it->m_spawning == this)
+                return true;
+        
+        return false;
+    }
+    
+    // A waiter may leave during its own delivery (from a callback), but otherwise waits until it is unpinned
+    
+    bool delivering(flight_registry& registry) const
+    {
+        for (auto it = registry.m_deliveries.begin(); it != registry.m_deliveries.end(); it++)
+        {
+            auto& waiters = it->m_waiters;
+            
+            if (it->m_thread != std::this_thread::get_id() && std::find(waiters.begin(), waiters.end(), this) != waiters.end())
+                return true;
+        }
+        
+        return false;
+    }
+    
+    // N.B. Don't hold the lock of a waiting service when calling this as that can cause deadlocks
+    
+    void leave()
+    {
+        auto& registry = flights();
+        registry_lock lock(registry.m_mutex);
+        
+        registry.m_cond.wait(lock, [&](){ return !spawning(registry) && !delivering(registry); });
+        
+        for (auto it = registry.m_deliveries.begin(); it != registry.m_deliveries.end(); it++)
+            it->m_waiters.remove(this);
+        
+        for (auto it = registry.m_flights.begin(); it != registry.m_flights.end(); it++)
+        {
+            if (it->m_leader == this)
+            {
+                hand_over(registry, lock, it);
+                return;
+            }
+            
+            it->m_waiters.remove(this);
+        }
+    }
+    
+    // Hands a resolve to each waiter in turn until one starts (the registry is unlocked whilst starting)
+    
+    static void hand_over(flight_registry& registry, registry_lock& lock, std::list<flight>::iterator it)
+    {
+        while (!it->m_waiters.empty())
+        {
+            auto waiter = it->m_waiters.front();
+            
+            it->m_waiters.pop_front();
+            it->m_leader = waiter;
+            it->m_spawning = waiter;
+            
+            lock.unlock();
+            bool spawned = waiter->spawn(waiter, waiter->name(), waiter->regtype(), waiter->domain());
+            
+            if (!spawned)
+                waiter->m_signal.notify();
+            
+            lock.lock();
+            it->m_spawning = nullptr;
+            registry.m_cond.notify_all();
+            
+            if (spawned)
+                return;
+        }
+        
+        registry.m_flights.erase(it);
+    }
+    
+    // Waiters are passed the result once the reply has been processed (so that no locks are held for callbacks)
+    
+    void complete_flight(const char *fullname, const char *host, uint16_t port, const bonjour_txt& txt, bool complete)
+    {
+        auto& registry = flights();
+        registry_lock lock(registry.m_mutex);
+        
+        registry.m_cond.wait(lock, [&](){ return !spawning(registry); });
+        
+        auto it = find(registry.m_flights);
+        
+        if (it == registry.m_flights.end() || it->m_leader != this)
+            return;
+        
+        auto jt = registry.m_deliveries.insert(registry.m_deliveries.end(), delivery());
+        
+        jt->m_thread = std::this_thread::get_id();
+        std::swap(jt->m_waiters, it->m_waiters);
+        registry.m_flights.erase(it);
+        
+        if (jt->m_waiters.empty())
+        {
+            registry.m_deliveries.erase(jt);
+            return;
+        }
+        
+        std::string fullname_str(fullname);
+        std::string host_str(host);
+        
+        impl::deferred().push_back([jt, fullname_str, host_str, port, txt, complete]()
+        {
+            deliver(jt, fullname_str.c_str(), host_str.c_str(), port, txt, complete);
+        });
+    }
+    
+    static void deliver(std::list<delivery>::iterator it, const char *fullname, const char *host, uint16_t port, const bonjour_txt& txt, bool complete)
+    {
+        auto& registry = flights();
+        registry_lock lock(registry.m_mutex);
+        
+        while (!it->m_waiters.empty())
+        {
+            auto waiter = it->m_waiters.front();
+            
+            lock.unlock();
+            
+            {
+                mutex_lock lock(waiter->m_mutex);
+                
+                waiter->m_fullname = fullname;
+                waiter->m_host = host;
+                waiter->m_port = port;
+                waiter->m_txt = txt;
+                waiter->m_draining = txt.contains(bonjour_txt::draining_key());
+                waiter->m_resolved = true;
+            }
+            
+            // N.B. The waiter may be destroyed by its callback, so it is not used again afterwards
+            
+            waiter->m_signal.notify();
+            waiter->notify_observer();
+            notify(bonjour_callback::resolve, waiter->m_notify.m_resolve, waiter, fullname, host, port, complete);
+            
+            lock.lock();
+            it->m_waiters.remove(waiter);
+            registry.m_cond.notify_all();
+        }
+        
+        registry.m_deliveries.erase(it);
+    }
+    
+    // Errors stop the resolve (this hides the version in bonjour_base so that the resolve is handed over)
+    
+    template <typename T, typename ...Args>
+    void stop_notify(T func, Args...args)
+    {
+        stop();
+        notify(bonjour_callback::stop, func, args...);
+    }
+    
+    // The shared state of a lazy service, which creates the actual resolver on first use
+    
+    struct lazy_resolver
+    {
+        lazy_resolver()
+        {
+            impl::set_lock_class(m_mutex, "bonjour_service::lazy");
+        }
+        
+        mutex_type m_mutex;
+        std::shared_ptr<bonjour_service> m_service;
+    };
+    
+    // The resolver takes the notifications of the service that first starts it
+    
+    std::shared_ptr<bonjour_service> lazy_service() const
+    {
+        mutex_lock lock(m_lazy->m_mutex);
+        
+        if (!m_lazy->m_service)
+            m_lazy->m_service = std::make_shared<bonjour_service>(static_cast<const bonjour_named&>(*this),
+                                                                  m_notify,
+                                                                  false,
+                                                                  m_monitor);
+        
+        return m_lazy->m_service;
+    }
+    
+    // Returns the resolver only if it has been started (so that reading state does not start a resolve)
+    
+    std::shared_ptr<bonjour_service> lazy_started() const
+    {
+        mutex_lock lock(m_lazy->m_mutex);
+        return m_lazy->m_service;
+    }
+    
+    std::shared_ptr<address_lookup> current_lookup() const
+    {
+        mutex_lock lock(m_mutex);
+        return m_lookup;
+    }
+    
+    void reset_lookup(std::shared_ptr<address_lookup> lookup)
+    {
+        {
+            mutex_lock lock(m_mutex);
+            std::swap(lookup, m_lookup);
+        }
+        
+        // The previous lookup (if any) is released here without the lock held
+        
+        lookup.reset();
+    }
+    
+    void reply(DNSServiceFlags flags,
+               const char *fullname,
+               const char *host,
+               uint16_t port,
+               uint16_t txt_length,
+               const unsigned char *txt_record)
     {
         bool complete = (flags & kDNSServiceFlagsMoreComing) == 0;
 
         m_fullname = fullname;
         m_host = host;
         m_port = port;
-                
-        stop();
+        m_txt = bonjour_txt(txt_record, txt_length);
+        m_draining = m_txt.contains(bonjour_txt::draining_key());
+        m_resolved = true;
+        
+        // N.B. Leading a resolve is handed over by completing it, so the resolve is not left here
         
-        notify(m_notify.m_resolve, this, fullname, host, port, complete);
+        if (!m_monitor)
+        {
+            complete_flight(fullname, host, port, m_txt, complete);
+            bonjour_base::stop();
+        }
+        
+        m_signal.notify();
+        
+        notify(bonjour_callback::resolve, m_notify.m_resolve, this, fullname, host, port, complete);
     }
             
     std::string m_fullname;
     std::string m_host;
     uint16_t m_port;
+    std::string m_address;
+    bool m_resolved;
+    bonjour_txt m_txt;
+    bool m_draining;
+    bool m_monitor;
+    
+    std::shared_ptr<address_lookup> m_lookup;
+    std::shared_ptr<lazy_resolver> m_lazy;
+    mutable impl::change_signal m_signal;
     
     notify_type m_notify;
 };
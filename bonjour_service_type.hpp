@@ -0,0 +1,102 @@
+
+#ifndef BONJOUR_SERVICE_TYPE_HPP
+#define BONJOUR_SERVICE_TYPE_HPP
+
+#include "bonjour_browse.hpp"
+#include "bonjour_peer.hpp"
+#include "bonjour_register.hpp"
+
+#include <cstddef>
+
+// Service types that are checked at compile time and stored statically
+// Any type with a constexpr static regtype() can be used with the typed objects below
+// With C++20 use service_type<"_myapp._tcp">, otherwise declare one with BONJOUR_FOR_CPP_SERVICE_TYPE
+
+#define BONJOUR_FOR_CPP_SERVICE_TYPE(NAME, REGTYPE)                                                 \
+struct NAME                                                                                         \
+{                                                                                                   \
+    static_assert(impl::valid_regtype(REGTYPE), "service types should be _name._tcp or _name._udp");\
+    static constexpr const char *regtype() { return REGTYPE; }                                      \
+}
+
+#if __cplusplus >= 202002L
+
+namespace impl
+{
+    template <size_t N>
+    struct fixed_string
+    {
+        constexpr fixed_string(const char (&str)[N])
+        {
+            for (size_t i = 0; i < N; i++)
+                m_str[i] = str[i];
+        }
+        
+        char m_str[N] = {};
+    };
+}
+
+template <impl::fixed_string S>
+struct service_type
+{
+    static_assert(impl::valid_regtype(S.m_str), "service types should be _name._tcp or _name._udp");
+    
+    static constexpr const char *regtype() { return S.m_str; }
+};
+
+#endif
+
+// Typed versions of the main objects (which take their regtype from the service type)
+
+template <class T>
+class bonjour_typed_browse : public bonjour_browse
+{
+    static_assert(impl::valid_regtype(T::regtype()), "service types should be _name._tcp or _name._udp");
+    
+public:
+    
+    using service_type = T;
+    
+    bonjour_typed_browse(const char *domain,
+                         notify_type notify = notify_type(),
+                         bonjour_browse_options options = bonjour_browse_options())
+    : bonjour_browse(impl::static_regtype(T::regtype()), domain, notify, options)
+    {}
+};
+
+template <class T>
+class bonjour_typed_register : public bonjour_register
+{
+    static_assert(impl::valid_regtype(T::regtype()), "service types should be _name._tcp or _name._udp");
+    
+public:
+    
+    using service_type = T;
+    
+    bonjour_typed_register(const char *name,
+                           const char *domain,
+                           uint16_t port,
+                           notify_type notify = notify_type(),
+                           bonjour_register_options options = bonjour_register_options())
+    : bonjour_register(name, impl::static_regtype(T::regtype()), domain, port, notify, options)
+    {}
+};
+
+template <class T>
+class bonjour_typed_peer : public bonjour_peer
+{
+    static_assert(impl::valid_regtype(T::regtype()), "service types should be _name._tcp or _name._udp");
+    
+public:
+    
+    using service_type = T;
+    
+    bonjour_typed_peer(const char *name,
+                       const char *domain,
+                       uint16_t port,
+                       bonjour_peer_options options = bonjour_peer_options())
+    : bonjour_peer(name, impl::static_regtype(T::regtype()), domain, port, options)
+    {}
+};
+
+#endif /* BONJOUR_SERVICE_TYPE_HPP */
@@ -0,0 +1,426 @@
+
+#ifndef BONJOUR_SNAPSHOT_HPP
+#define BONJOUR_SNAPSHOT_HPP
+
+#include "bonjour_peer.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <list>
+#include <new>
+#include <thread>
+
+// A flat record of a resolved peer as stored in a shared-memory snapshot
+
+struct bonjour_snapshot_entry
+{
+    char m_name[64];
+    char m_regtype[64];
+    char m_domain[256];
+    char m_host[256];
+    char m_address[64];
+    uint16_t m_port;
+};
+
+namespace impl
+{
+    struct snapshot_header
+    {
+        static constexpr uint32_t magic = 0x424A5348;
+        
+        uint32_t m_magic;
+        uint32_t m_capacity;
+        std::atomic<uint64_t> m_sequence;
+        uint32_t m_count;
+        std::atomic<uint32_t> m_closed;
+    };
+    
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "snapshots need a lock-free sequence counter");
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "snapshots need a lock-free closed flag");
+    
+    inline size_t snapshot_size(uint32_t capacity)
+    {
+        return sizeof(snapshot_header) + capacity * sizeof(bonjour_snapshot_entry);
+    }
+    
+    inline bonjour_snapshot_entry *snapshot_entries(void *memory)
+    {
+        return reinterpret_cast<bonjour_snapshot_entry *>(static_cast<char *>(memory) + sizeof(snapshot_header));
+    }
+    
+    template <size_t N>
+    void copy_string(char (&dst)[N], const char *src)
+    {
+        strncpy(dst, src, N - 1);
+        dst[N - 1] = 0;
+    }
+}
+
+// An object that writes a peer set to a named shared-memory segment (versioned with a seqlock)
+// There should be a single writer per segment
+// A writer always creates a new segment (replacing any existing one), so mapped segments are never resized
+// Segments are left in place when the writer is destroyed, but marked as closed so that readers can reopen
+
+class bonjour_snapshot_writer
+{
+public:
+    
+    bonjour_snapshot_writer(const char *name, uint32_t capacity)
+    : m_memory(nullptr)
+    , m_size(impl::snapshot_size(capacity))
+    {
+        int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+        
+        if (fd < 0 && errno == EEXIST)
+        {
+            remove(name);
+            fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+        }
+        
+        if (fd < 0)
+            return;
+        
+        if (!ftruncate(fd, m_size))
+        {
+            void *memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            
+            if (memory != MAP_FAILED)
+                m_memory = memory;
+        }
+        
+        close(fd);
+        
+        if (m_memory)
+        {
+            auto header = new (m_memory) impl::snapshot_header();
+            
+            header->m_capacity = capacity;
+            header->m_count = 0;
+            header->m_sequence.store(0, std::memory_order_relaxed);
+            header->m_closed.store(0, std::memory_order_relaxed);
+            header->m_magic = impl::snapshot_header::magic;
+        }
+    }
+    
+    ~bonjour_snapshot_writer()
+    {
+        if (m_memory)
+        {
+            static_cast<impl::snapshot_header *>(m_memory)->m_closed.store(1, std::memory_order_release);
+            munmap(m_memory, m_size);
+        }
+    }
+    
+    // Removes a segment (readers that still have it mapped see it as closed)
+    
+    static void remove(const char *name)
+    {
+        int fd = shm_open(name, O_RDWR, 0);
+        
+        if (fd >= 0)
+        {
+            struct stat info;
+            
+            if (!fstat(fd, &info) && static_cast<size_t>(info.st_size) >= sizeof(impl::snapshot_header))
+            {
+                void *memory = mmap(nullptr, sizeof(impl::snapshot_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                
+                if (memory != MAP_FAILED)
+                {
+                    auto header = static_cast<impl::snapshot_header *>(memory);
+                    
+                    if (header->m_magic == impl::snapshot_header::magic)
+                        header->m_closed.store(1, std::memory_order_release);
+                    
+                    munmap(memory, sizeof(impl::snapshot_header));
+                }
+            }
+            
+            close(fd);
+        }
+        
+        shm_unlink(name);
+    }
+    
+    bonjour_snapshot_writer(bonjour_snapshot_writer const& rhs) = delete;
+    void operator = (bonjour_snapshot_writer const& rhs) = delete;
+    
+    bool valid() const
+    {
+        return m_memory;
+    }
+    
+    // Writes the peers (peers beyond the capacity of the segment are dropped)
+    
+    bool publish(std::list<bonjour_service>& peers)
+    {
+        if (!m_memory)
+            return false;
+        
+        auto header = static_cast<impl::snapshot_header *>(m_memory);
+        auto entries = impl::snapshot_entries(m_memory);
+        auto sequence = header->m_sequence.load(std::memory_order_relaxed);
+        
+        uint32_t count = 0;
+        
+        // An odd sequence marks a write in progress
+        
+        header->m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        
+        for (auto it = peers.begin(); it != peers.end() && count < header->m_capacity; it++, count++)
+        {
+            auto& entry = entries[count];
+            
+            impl::copy_string(entry.m_name, it->name());
+            impl::copy_string(entry.m_regtype, it->regtype());
+            impl::copy_string(entry.m_domain, it->domain());
+            impl::copy_string(entry.m_host, it->host().c_str());
+            impl::copy_string(entry.m_address, it->address().c_str());
+            entry.m_port = it->port();
+        }
+        
+        header->m_count = count;
+        header->m_sequence.store(sequence + 2, std::memory_order_release);
+        
+        return true;
+    }
+    
+private:
+    
+    void *m_memory;
+    size_t m_size;
+};
+
+// An object that reads a peer set from a shared-memory segment without locking or allocating
+
+class bonjour_snapshot_reader
+{
+public:
+    
+    bonjour_snapshot_reader(const char *name)
+    : m_memory(nullptr)
+    , m_size(0)
+    {
+        int fd = shm_open(name, O_RDONLY, 0);
+        
+        if (fd < 0)
+            return;
+        
+        struct stat info;
+        
+        if (!fstat(fd, &info) && static_cast<size_t>(info.st_size) >= sizeof(impl::snapshot_header))
+        {
+            void *memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            
+            if (memory != MAP_FAILED)
+            {
+                m_memory = memory;
+                m_size = info.st_size;
+            }
+        }
+        
+        close(fd);
+        
+        if (m_memory && (header()->m_magic != impl::snapshot_header::magic ||
+                         impl::snapshot_size(header()->m_capacity) > m_size))
+        {
+            munmap(m_memory, m_size);
+            m_memory = nullptr;
+        }
+    }
+    
+    ~bonjour_snapshot_reader()
+    {
+        if (m_memory)
+            munmap(m_memory, m_size);
+    }
+    
+    bonjour_snapshot_reader(bonjour_snapshot_reader const& rhs) = delete;
+    void operator = (bonjour_snapshot_reader const& rhs) = delete;
+    
+    bool valid() const
+    {
+        return m_memory;
+    }
+    
+    // A closed segment will not be published to again (a new reader should be opened to see any new writer)
+    
+    bool closed() const
+    {
+        return !m_memory || header()->m_closed.load(std::memory_order_acquire);
+    }
+    
+    // The sequence changes (by two) on every publish, so can be polled cheaply for changes
+    
+    uint64_t sequence() const
+    {
+        return m_memory ? header()->m_sequence.load(std::memory_order_acquire) : 0;
+    }
+    
+    // Copies up to max_count entries and sets count to the number of peers (which may be more than max_count)
+    // Returns false if no consistent copy could be made (for example if the writer died whilst publishing)
+    
+    bool read(bonjour_snapshot_entry *peers, size_t max_count, size_t& count, uint64_t *read_sequence = nullptr) const
+    {
+        count = 0;
+        
+        if (!m_memory)
+            return false;
+        
+        auto entries = impl::snapshot_entries(m_memory);
+        
+        for (int i = 0; i < max_attempts; i++)
+        {
+            auto sequence = header()->m_sequence.load(std::memory_order_acquire);
+            
+            if (sequence & 1)
+            {
+                if (closed())
+                    return false;
+                
+                std::this_thread::yield();
+                continue;
+            }
+            
+            size_t entry_count = header()->m_count;
+            
+            if (entry_count > header()->m_capacity)
+                continue;
+            
+            memcpy(peers, entries, std::min(entry_count, max_count) * sizeof(bonjour_snapshot_entry));
+            
+            std::atomic_thread_fence(std::memory_order_acquire);
+            
+            if (header()->m_sequence.load(std::memory_order_relaxed) == sequence)
+            {
+                if (read_sequence)
+                    *read_sequence = sequence;
+                
+                count = entry_count;
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+private:
+    
+    // Publishes are short, so this many failed attempts means that the writer has stalled or died
+    
+    static constexpr int max_attempts = 4096;
+    
+    const impl::snapshot_header *header() const
+    {
+        return static_cast<const impl::snapshot_header *>(m_memory);
+    }
+    
+    void *m_memory;
+    size_t m_size;
+};
+
+// An object that publishes the resolved peers of a bonjour_peer to shared memory whenever they change
+// Changes are checked on every browse change and at least once per interval (in seconds)
+
+class bonjour_snapshot_publisher
+{
+public:
+    
+    bonjour_snapshot_publisher(bonjour_peer& peer, const char *name, uint32_t capacity, double interval = 1.0)
+    : m_peer(peer)
+    , m_writer(name, capacity)
+    , m_interval(interval)
+    , m_running(true)
+    , m_thread(do_loop, this)
+    {}
+    
+    ~bonjour_snapshot_publisher()
+    {
+        m_running = false;
+        m_thread.join();
+    }
+    
+    bonjour_snapshot_publisher(bonjour_snapshot_publisher const& rhs) = delete;
+    void operator = (bonjour_snapshot_publisher const& rhs) = delete;
+    
+    bool valid() const
+    {
+        return m_writer.valid();
+    }
+    
+private:
+    
+    static void do_loop(bonjour_snapshot_publisher *publisher)
+    {
+        publisher->loop();
+    }
+    
+    void loop()
+    {
+        std::list<bonjour_service> peers;
+        std::list<bonjour_service> published;
+        bool first = true;
+        
+        auto interval = std::chrono::duration_cast<bonjour_clock::duration>(std::chrono::duration<double>(m_interval));
+        auto tick = std::min<bonjour_clock::duration>(interval, std::chrono::milliseconds(100));
+        auto next = bonjour_clock::now();
+        
+        while (m_running)
+        {
+            auto generation = m_peer.generation();
+            
+            if (bonjour_clock::now() >= next)
+            {
+                m_peer.list_peers(peers);
+                
+                // Consumers need a host to connect to, so only resolved peers are published
+                
+                peers.remove_if([](const bonjour_service& peer) { return !peer.resolved(); });
+                
+                if (first || !same(peers, published))
+                {
+                    m_writer.publish(peers);
+                    published = peers;
+                    first = false;
+                }
+                
+                next = bonjour_clock::now() + interval;
+            }
+            
+            // Wake promptly on browse changes, but also check regularly so that the thread can exit
+            
+            if (m_peer.wait_for_change(generation, bonjour_clock::now() + tick))
+                next = bonjour_clock::now();
+        }
+    }
+    
+    static bool same(std::list<bonjour_service>& a, std::list<bonjour_service>& b)
+    {
+        if (a.size() != b.size())
+            return false;
+        
+        for (auto it = a.begin(), jt = b.begin(); it != a.end(); it++, jt++)
+        {
+            if (!it->equal(*jt) || it->port() != jt->port() || it->host() != jt->host() || it->address() != jt->address())
+                return false;
+        }
+        
+        return true;
+    }
+    
+    bonjour_peer& m_peer;
+    bonjour_snapshot_writer m_writer;
+    double m_interval;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+};
+
+#endif /* BONJOUR_SNAPSHOT_HPP */
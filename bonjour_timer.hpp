@@ -0,0 +1,295 @@
+
+#ifndef BONJOUR_TIMER_HPP
+#define BONJOUR_TIMER_HPP
+
+#include "bonjour_base.hpp"
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// A hierarchical timer wheel shared by all deadlines in the library (running on a single thread)
+// Timers are inserted and cancelled in constant time, and the thread only wakes for slots that are occupied
+// Callbacks run on the timer thread and should be short
+
+class bonjour_timers
+{
+    static constexpr int slot_bits = 8;
+    static constexpr int num_levels = 4;
+    static constexpr uint64_t num_slots = 1 << slot_bits;
+    static constexpr uint64_t slot_mask = num_slots - 1;
+    
+    struct timer
+    {
+        uint64_t m_id;
+        uint64_t m_expiry;
+        std::function<void()> m_callback;
+    };
+    
+    using slot_type = std::list<timer>;
+    
+    struct location
+    {
+        slot_type *m_slot;
+        slot_type::iterator m_it;
+    };
+    
+public:
+    
+    using timer_id = uint64_t;
+    
+    // The resolution of the wheel
+    
+    static constexpr std::chrono::milliseconds tick = std::chrono::milliseconds(10);
+    
+    // N.B. This is never destroyed as detached threads may still be cancelling timers at exit
+    
+    static bonjour_timers& shared()
+    {
+        static bonjour_timers *timers = new bonjour_timers;
+        return *timers;
+    }
+    
+    ~bonjour_timers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+        
+        m_cond.notify_all();
+        
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+    
+    bonjour_timers(bonjour_timers const& rhs) = delete;
+    void operator = (bonjour_timers const& rhs) = delete;
+    
+    // Returns an id for cancellation (ids are never zero)
+    
+    timer_id schedule(bonjour_clock::time_point when, std::function<void()> callback)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        if (!m_thread.joinable())
+            m_thread = std::thread(do_loop, this);
+        
+        // An empty wheel can skip straight to the current time
+        
+        if (m_locations.empty())
+            m_now = std::max(m_now, to_ticks(bonjour_clock::now()));
+        
+        auto id = ++m_last_id;
+        auto expiry = to_ticks(when);
+        
+        insert(timer{ id, expiry < m_now + 1 ? m_now + 1 : expiry, std::move(callback) });
+        m_cond.notify_all();
+        
+        return id;
+    }
+    
+    timer_id schedule(double seconds, std::function<void()> callback)
+    {
+        auto delay = std::chrono::duration_cast<bonjour_clock::duration>(std::chrono::duration<double>(seconds));
+        return schedule(bonjour_clock::now() + delay, std::move(callback));
+    }
+    
+    // Returns false if the timer has already fired (if it is running on another thread this waits for it)
+    
+    bool cancel(timer_id id)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        
+        auto it = m_locations.find(id);
+        
+        if (it != m_locations.end())
+        {
+            it->second.m_slot->erase(it->second.m_it);
+            m_locations.erase(it);
+            return true;
+        }
+        
+        // Expired timers waiting behind another callback can still be cancelled
+        
+        if (m_pending.erase(id))
+            return true;
+        
+        if (m_thread.get_id() != std::this_thread::get_id())
+            m_cond.wait(lock, [&](){ return m_running != id; });
+        
+        return false;
+    }
+    
+private:
+    
+    bonjour_timers()
+    : m_start(bonjour_clock::now())
+    , m_now(0)
+    , m_last_id(0)
+    , m_running(0)
+    , m_exit(false)
+    {}
+    
+    uint64_t to_ticks(bonjour_clock::time_point when) const
+    {
+        if (when <= m_start)
+            return 0;
+        
+        return static_cast<uint64_t>((when - m_start + tick - bonjour_clock::duration(1)) / tick);
+    }
+    
+    bonjour_clock::time_point to_time(uint64_t ticks) const
+    {
+        return m_start + ticks * tick;
+    }
+    
+    // Timers are placed at the lowest level whose span covers the remaining time
+    
+    void insert(timer t)
+    {
+        auto delta = t.m_expiry - m_now;
+        int level = 0;
+        
+        while (level < num_levels - 1 && delta >= (num_slots << (level * slot_bits)))
+            level++;
+        
+        auto shift = level * slot_bits;
+        auto index = level == num_levels - 1 && delta >= (num_slots << (level * slot_bits))
+                    ? (m_now >> shift) + slot_mask
+                    : t.m_expiry >> shift;
+        
+        auto& slot = m_wheel[level][index & slot_mask];
+        auto id = t.m_id;
+        
+        slot.push_back(std::move(t));
+        m_locations[id] = location{ &slot, --slot.end() };
+    }
+    
+    // Moves the wheel on by one tick, collecting any timers that have expired
+    
+    void advance(std::list<timer>& expired)
+    {
+        m_now++;
+        
+        // Cascade higher levels down as each lower level wraps (starting from the highest level that wraps)
+        
+        int top = 0;
+        
+        while (top < num_levels - 1 && !(m_now & ((uint64_t(1) << ((top + 1) * slot_bits)) - 1)))
+            top++;
+        
+        for (int level = top; level > 0; level--)
+        {
+            auto& slot = m_wheel[level][(m_now >> (level * slot_bits)) & slot_mask];
+            slot_type timers;
+            
+            timers.splice(timers.end(), slot);
+            
+            for (auto it = timers.begin(); it != timers.end(); it++)
+            {
+                m_locations.erase(it->m_id);
+                insert(std::move(*it));
+            }
+        }
+        
+        auto& slot = m_wheel[0][m_now & slot_mask];
+        
+        for (auto it = slot.begin(); it != slot.end(); )
+        {
+            auto jt = it++;
+            
+            if (jt->m_expiry <= m_now)
+            {
+                m_locations.erase(jt->m_id);
+                m_pending.insert(jt->m_id);
+                expired.splice(expired.end(), slot, jt);
+            }
+        }
+    }
+    
+    // The number of ticks that can be skipped before anything needs to happen
+    
+    uint64_t ticks_to_next() const
+    {
+        for (uint64_t i = 1; i <= num_slots; i++)
+        {
+            auto next = m_now + i;
+            
+            if (!m_wheel[0][next & slot_mask].empty() || !(next & slot_mask))
+                return i;
+        }
+        
+        return num_slots;
+    }
+    
+    static void do_loop(bonjour_timers *timers)
+    {
+        timers->loop();
+    }
+    
+    void loop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        
+        while (!m_exit)
+        {
+            if (m_locations.empty())
+            {
+                m_cond.wait(lock);
+                continue;
+            }
+            
+            auto target = m_now + ticks_to_next();
+            
+            if (bonjour_clock::now() < to_time(target))
+            {
+                m_cond.wait_until(lock, to_time(target));
+                continue;
+            }
+            
+            std::list<timer> expired;
+            
+            while (m_now < target)
+                advance(expired);
+            
+            // Run the callbacks without holding the lock
+            
+            for (auto it = expired.begin(); it != expired.end(); it++)
+            {
+                if (!m_pending.erase(it->m_id))
+                    continue;
+                
+                m_running = it->m_id;
+                lock.unlock();
+                it->m_callback();
+                lock.lock();
+                m_running = 0;
+                m_cond.notify_all();
+            }
+        }
+    }
+    
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    
+    std::array<std::array<slot_type, num_slots>, num_levels> m_wheel;
+    std::unordered_map<timer_id, location> m_locations;
+    std::unordered_set<timer_id> m_pending;
+    
+    bonjour_clock::time_point m_start;
+    uint64_t m_now;
+    timer_id m_last_id;
+    timer_id m_running;
+    bool m_exit;
+    
+    std::thread m_thread;
+};
+
+#endif /* BONJOUR_TIMER_HPP */
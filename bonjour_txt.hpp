@@ -0,0 +1,163 @@
+
+#ifndef BONJOUR_TXT_HPP
+#define BONJOUR_TXT_HPP
+
+#include <strings.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// A TXT record (a sequence of key or key=value strings, each preceded by its length)
+// Keys are matched without regard to case, as in DNS-SD
+
+class bonjour_txt
+{
+public:
+    
+    // The key set whilst a registration is draining
+    
+    static constexpr const char *draining_key() { return "draining"; }
+    
+    bonjour_txt() {}
+    
+    bonjour_txt(const void *data, size_t length)
+    {
+        assign(data, length);
+    }
+    
+    // Malformed records are treated as empty
+    
+    void assign(const void *data, size_t length)
+    {
+        m_data.assign(static_cast<const char *>(data), length);
+        
+        for (size_t i = 0; i < m_data.length(); i += static_cast<unsigned char>(m_data[i]) + 1)
+        {
+            if (i + static_cast<unsigned char>(m_data[i]) >= m_data.length())
+            {
+                m_data.clear();
+                break;
+            }
+        }
+        
+        if (m_data.length() == 1 && !m_data[0])
+            m_data.clear();
+    }
+    
+    // Sets a key with a value, or with no value if value is null (returning false if the entry is too long)
+    
+    bool set(const char *key, const char *value = nullptr)
+    {
+        size_t length = strlen(key) + (value ? strlen(value) + 1 : 0);
+        
+        if (!strlen(key) || strchr(key, '=') || length > 255 || m_data.length() + length + 1 > UINT16_MAX)
+            return false;
+        
+        remove(key);
+        
+        m_data += static_cast<char>(length);
+        m_data += key;
+        
+        if (value)
+        {
+            m_data += '=';
+            m_data += value;
+        }
+        
+        return true;
+    }
+    
+    bool remove(const char *key)
+    {
+        size_t offset, length;
+        
+        if (!find(key, offset, length))
+            return false;
+        
+        m_data.erase(offset, length + 1);
+        return true;
+    }
+    
+    bool contains(const char *key) const
+    {
+        size_t offset, length;
+        return find(key, offset, length);
+    }
+    
+    // Returns false if the key is not present (keys with no value give an empty string)
+    
+    bool get(const char *key, std::string& value) const
+    {
+        size_t offset, length;
+        
+        if (!find(key, offset, length))
+            return false;
+        
+        size_t key_length = strlen(key);
+        
+        if (length > key_length)
+            value.assign(m_data, offset + key_length + 2, length - key_length - 1);
+        else
+            value.clear();
+        
+        return true;
+    }
+    
+    bool empty() const
+    {
+        return m_data.empty();
+    }
+    
+    // An empty record is represented by a single empty string
+    
+    const char *data() const
+    {
+        return m_data.empty() ? "" : m_data.data();
+    }
+    
+    uint16_t length() const
+    {
+        return m_data.empty() ? 1 : static_cast<uint16_t>(m_data.length());
+    }
+    
+    bool operator == (const bonjour_txt& rhs) const
+    {
+        return m_data == rhs.m_data;
+    }
+    
+    bool operator != (const bonjour_txt& rhs) const
+    {
+        return m_data != rhs.m_data;
+    }
+    
+private:
+    
+    // Finds the offset of the length byte of the entry for a key (and the length of the entry)
+    
+    bool find(const char *key, size_t& offset, size_t& length) const
+    {
+        size_t key_length = strlen(key);
+        
+        for (size_t i = 0; i < m_data.length(); i += static_cast<unsigned char>(m_data[i]) + 1)
+        {
+            size_t entry_length = static_cast<unsigned char>(m_data[i]);
+            
+            if (entry_length < key_length || (entry_length > key_length && m_data[i + key_length + 1] != '='))
+                continue;
+            
+            if (!strncasecmp(m_data.data() + i + 1, key, key_length))
+            {
+                offset = i;
+                length = entry_length;
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    std::string m_data;
+};
+
+#endif /* BONJOUR_TXT_HPP */
@@ -0,0 +1,226 @@
+
+#ifndef BONJOUR_TXT_SCHEMA_HPP
+#define BONJOUR_TXT_SCHEMA_HPP
+
+#include "bonjour_register.hpp"
+#include "bonjour_txt.hpp"
+
+#include <charconv>
+#include <cstring>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+// A field of a TXT schema (mapping a key to a member of a struct)
+// Integers are written in decimal, bools as a key with no value (present when true) and strings as they are
+
+template <class S, class T>
+struct bonjour_txt_field
+{
+    const char *m_key;
+    T S::*m_member;
+};
+
+template <class S, class T>
+constexpr bonjour_txt_field<S, T> bonjour_field(const char *key, T S::*member)
+{
+    static_assert(std::is_integral<T>::value || std::is_same<T, std::string_view>::value,
+                  "TXT fields should be integers, bools or string views");
+    
+    return { key, member };
+}
+
+namespace impl
+{
+    // Appends a single entry to a TXT record (returning false if it does not fit)
+    
+    inline bool txt_append(char *buffer, size_t capacity, size_t& offset, const char *key, const char *value, size_t value_length)
+    {
+        size_t key_length = strlen(key);
+        size_t length = key_length + (value ? value_length + 1 : 0);
+        
+        if (length > 255 || offset + length + 1 > capacity)
+            return false;
+        
+        buffer[offset++] = static_cast<char>(length);
+        memcpy(buffer + offset, key, key_length);
+        offset += key_length;
+        
+        if (value)
+        {
+            buffer[offset++] = '=';
+            memcpy(buffer + offset, value, value_length);
+            offset += value_length;
+        }
+        
+        return true;
+    }
+    
+    // Finds the value of a key in a TXT record (keys with no value give a null view)
+    
+    inline bool txt_find(const char *data, size_t length, const char *key, std::string_view& value)
+    {
+        size_t key_length = strlen(key);
+        
+        for (size_t i = 0; i < length; i += static_cast<unsigned char>(data[i]) + 1)
+        {
+            size_t entry_length = static_cast<unsigned char>(data[i]);
+            const char *entry = data + i + 1;
+            
+            if (i + entry_length >= length)
+                return false;
+            
+            if (entry_length < key_length || strncasecmp(entry, key, key_length))
+                continue;
+            
+            if (entry_length == key_length)
+            {
+                value = std::string_view();
+                return true;
+            }
+            
+            if (entry[key_length] == '=')
+            {
+                value = std::string_view(entry + key_length + 1, entry_length - key_length - 1);
+                return true;
+            }
+        }
+        
+        return false;
+    }
+}
+
+// A compile-time description of how a struct maps to a TXT record
+// Encoding writes to a caller-supplied buffer (without allocating) and decoding parses in place
+// Decoded strings are views into the TXT data, so they are only valid whilst that data is
+// Integers are parsed with from_chars (so parsing does not depend on the locale)
+
+template <class S, class ...Ts>
+class bonjour_txt_schema
+{
+public:
+    
+    // TXT records should fit in a single packet
+    
+    static constexpr size_t max_length = 1300;
+    
+    constexpr bonjour_txt_schema(bonjour_txt_field<S, Ts>... fields)
+    : m_fields(fields...)
+    {}
+    
+    // Returns the length of the record (or zero if it does not fit in the buffer)
+    
+    size_t encode(const S& value, char *buffer, size_t capacity) const
+    {
+        size_t offset = 0;
+        
+        auto encode_all = [&](const auto& ...fields)
+        {
+            return (encode_field(value, fields, buffer, capacity, offset) && ...);
+        };
+        
+        if (!std::apply(encode_all, m_fields))
+            return 0;
+        
+        // An empty record is represented by a single empty string
+        
+        if (!offset && capacity)
+            buffer[offset++] = 0;
+        
+        return offset;
+    }
+    
+    template <size_t N>
+    size_t encode(const S& value, char (&buffer)[N]) const
+    {
+        return encode(value, buffer, N);
+    }
+    
+    // Fields that are missing are left unchanged (except bools which are false)
+    // Returns false if any field that is present cannot be parsed
+    
+    bool decode(const void *data, size_t length, S& value) const
+    {
+        auto decode_all = [&](const auto& ...fields)
+        {
+            return (decode_field(static_cast<const char *>(data), length, value, fields) & ...);
+        };
+        
+        return std::apply(decode_all, m_fields);
+    }
+    
+    bool decode(const bonjour_txt& txt, S& value) const
+    {
+        return decode(txt.data(), txt.length(), value);
+    }
+    
+    // Encodes on the stack and updates the registration in place
+    
+    bool publish(bonjour_register& registration, const S& value) const
+    {
+        char buffer[max_length];
+        size_t length = encode(value, buffer);
+        
+        return length && registration.set_txt(buffer, static_cast<uint16_t>(length));
+    }
+    
+private:
+    
+    template <class T>
+    static bool encode_field(const S& value, const bonjour_txt_field<S, T>& field, char *buffer, size_t capacity, size_t& offset)
+    {
+        const T& member = value.*field.m_member;
+        
+        if constexpr (std::is_same<T, bool>::value)
+            return !member || impl::txt_append(buffer, capacity, offset, field.m_key, nullptr, 0);
+        else if constexpr (std::is_integral<T>::value)
+        {
+            char str[24];
+            auto result = std::to_chars(str, str + sizeof(str), member);
+            
+            return impl::txt_append(buffer, capacity, offset, field.m_key, str, result.ptr - str);
+        }
+        else
+            return impl::txt_append(buffer, capacity, offset, field.m_key, member.data(), member.length());
+    }
+    
+    template <class T>
+    static bool decode_field(const char *data, size_t length, S& value, const bonjour_txt_field<S, T>& field)
+    {
+        T& member = value.*field.m_member;
+        std::string_view str;
+        
+        bool found = impl::txt_find(data, length, field.m_key, str);
+        
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            member = found && str != "0" && str != "false";
+            return true;
+        }
+        else if constexpr (std::is_integral<T>::value)
+        {
+            if (!found)
+                return true;
+            
+            T parsed = 0;
+            auto result = std::from_chars(str.data(), str.data() + str.length(), parsed);
+            
+            if (result.ec != std::errc() || result.ptr != str.data() + str.length())
+                return false;
+            
+            member = parsed;
+            return true;
+        }
+        else
+        {
+            if (found)
+                member = str;
+            
+            return true;
+        }
+    }
+    
+    std::tuple<bonjour_txt_field<S, Ts>...> m_fields;
+};
+
+#endif /* BONJOUR_TXT_SCHEMA_HPP */
@@ -0,0 +1,153 @@
+
+#ifndef BONJOUR_WATCHDOG_HPP
+#define BONJOUR_WATCHDOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+class bonjour_base;
+
+// The notifications that can be made to user callbacks
+
+enum class bonjour_callback { stop, add, remove, resolve, address, drained, watch };
+
+inline const char *bonjour_callback_name(bonjour_callback callback)
+{
+    switch (callback)
+    {
+        case bonjour_callback::stop:        return "stop";
+        case bonjour_callback::add:         return "add";
+        case bonjour_callback::remove:      return "remove";
+        case bonjour_callback::resolve:     return "resolve";
+        case bonjour_callback::address:     return "address";
+        case bonjour_callback::drained:     return "drained";
+        case bonjour_callback::watch:       return "watch";
+    }
+    
+    return "";
+}
+
+// A report of a callback that took longer than its threshold
+// N.B. The callback may have destroyed the object, so the pointer should only be used to identify it
+
+struct bonjour_slow_callback
+{
+    const bonjour_base *m_object;
+    bonjour_callback m_callback;
+    double m_duration;
+    double m_threshold;
+};
+
+// Times user callbacks and reports any that exceed their threshold (in seconds)
+// Callbacks run on the reply thread (or strand) of their object, so slow ones delay every later reply for it
+// Timing is off until a threshold is set and reports are made on the thread of the callback
+
+class bonjour_watchdog
+{
+public:
+    
+    using report_type = void(*)(const bonjour_slow_callback&);
+    
+    static constexpr int num_callbacks = 7;
+    
+    // A threshold of zero disables timing
+    
+    static void set_threshold(double seconds)
+    {
+        for (int i = 0; i < num_callbacks; i++)
+            state().m_thresholds[i] = seconds;
+        
+        update();
+    }
+    
+    static void set_threshold(bonjour_callback callback, double seconds)
+    {
+        state().m_thresholds[static_cast<int>(callback)] = seconds;
+        update();
+    }
+    
+    static double threshold(bonjour_callback callback)
+    {
+        return state().m_thresholds[static_cast<int>(callback)];
+    }
+    
+    static void set_report(report_type report)
+    {
+        state().m_report = report;
+    }
+    
+    static bool enabled()
+    {
+        return state().m_enabled.load(std::memory_order_relaxed);
+    }
+    
+    // The number of slow callbacks and the longest callback since the last reset
+    
+    static uint64_t slow_callbacks()
+    {
+        return state().m_slow;
+    }
+    
+    static double max_duration()
+    {
+        return state().m_max_duration;
+    }
+    
+    static void reset()
+    {
+        state().m_slow = 0;
+        state().m_max_duration = 0.0;
+    }
+    
+    // Checks the duration of a callback that has just returned
+    
+    static void check(bonjour_callback callback, const bonjour_base *object, std::chrono::steady_clock::duration duration)
+    {
+        auto& watchdog = state();
+        
+        double seconds = std::chrono::duration<double>(duration).count();
+        double threshold = watchdog.m_thresholds[static_cast<int>(callback)];
+        double max = watchdog.m_max_duration;
+        
+        while (seconds > max && !watchdog.m_max_duration.compare_exchange_weak(max, seconds));
+        
+        if (threshold <= 0.0 || seconds <= threshold)
+            return;
+        
+        watchdog.m_slow++;
+        
+        if (report_type report = watchdog.m_report)
+            report(bonjour_slow_callback{ object, callback, seconds, threshold });
+    }
+    
+private:
+    
+    struct watchdog_state
+    {
+        std::atomic<double> m_thresholds[num_callbacks] = {};
+        std::atomic<report_type> m_report { nullptr };
+        std::atomic<bool> m_enabled { false };
+        
+        std::atomic<uint64_t> m_slow { 0 };
+        std::atomic<double> m_max_duration { 0.0 };
+    };
+    
+    static watchdog_state& state()
+    {
+        static watchdog_state watchdog;
+        return watchdog;
+    }
+    
+    static void update()
+    {
+        bool enabled = false;
+        
+        for (int i = 0; i < num_callbacks; i++)
+            enabled = enabled || state().m_thresholds[i] > 0.0;
+        
+        state().m_enabled = enabled;
+    }
+};
+
+#endif /* BONJOUR_WATCHDOG_HPP */
@@ -2,34 +2,318 @@
 #ifndef BONJOUR_FOR_CPP_UTILS_HPP
 #define BONJOUR_FOR_CPP_UTILS_HPP
 
+#if defined(BONJOUR_FOR_CPP_WAIT_EPOLL)
+#include <sys/epoll.h>
+#elif defined(BONJOUR_FOR_CPP_WAIT_SELECT)
 #include <sys/select.h>
+#else
+#include <poll.h>
+#endif
 
+#include <sys/param.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 namespace impl
 {
-    int wait_on_socket(int socket, int timeout_secs, int timeout_usecs)
+    // A wait on a single socket for readability (with an optional wakeup descriptor that ends waits early)
+    // The backend is chosen at build time (poll by default, or define one of the flags below)
+    // BONJOUR_FOR_CPP_WAIT_EPOLL - use epoll (Linux only)
+    // BONJOUR_FOR_CPP_WAIT_SELECT - use select (sockets at or above FD_SETSIZE are reported as errors)
+    
+    class socket_waiter
     {
-        fd_set read, write, except;
-        struct timeval timeout;
-
-        // Timeout
+    public:
+        
+        socket_waiter(int socket, int wake = -1)
+        : m_socket(socket)
+        , m_wake(wake)
+#if defined(BONJOUR_FOR_CPP_WAIT_EPOLL)
+        , m_epoll(epoll_create1(EPOLL_CLOEXEC))
+#endif
+        {
+#if defined(BONJOUR_FOR_CPP_WAIT_EPOLL)
+            struct epoll_event event;
+            
+            event.events = EPOLLIN;
+            event.data.fd = socket;
+            
+            if (m_epoll >= 0 && epoll_ctl(m_epoll, EPOLL_CTL_ADD, socket, &event))
+            {
+                close(m_epoll);
+                m_epoll = -1;
+            }
+            
+            event.data.fd = wake;
+            
+            if (m_epoll >= 0 && wake >= 0 && epoll_ctl(m_epoll, EPOLL_CTL_ADD, wake, &event))
+                m_wake = -1;
+#endif
+        }
+        
+        ~socket_waiter()
+        {
+#if defined(BONJOUR_FOR_CPP_WAIT_EPOLL)
+            if (m_epoll >= 0)
+                close(m_epoll);
+#endif
+        }
+        
+        socket_waiter(socket_waiter const& rhs) = delete;
+        void operator = (socket_waiter const& rhs) = delete;
+        
+        // Returns a positive value if the socket is readable, zero on timeout or wakeup and a negative value on error
+        
+        int wait(int timeout_ms)
+        {
+#if defined(BONJOUR_FOR_CPP_WAIT_EPOLL)
+            struct epoll_event events[2];
+            
+            if (m_epoll < 0)
+                return -1;
+            
+            int rc = epoll_wait(m_epoll, events, 2, timeout_ms);
+            
+            if (rc < 0)
+                return errno == EINTR ? 0 : rc;
+            
+            for (int i = 0; i < rc; i++)
+                if (events[i].data.fd == m_socket)
+                    return 1;
+            
+            return 0;
+#elif defined(BONJOUR_FOR_CPP_WAIT_SELECT)
+            fd_set read;
+            struct timeval timeout;
+            
+            if (m_socket < 0 || m_socket >= FD_SETSIZE)
+                return -1;
+            
+            int wake = m_wake < FD_SETSIZE ? m_wake : -1;
+            
+            timeout.tv_sec = timeout_ms / 1000;
+            timeout.tv_usec = (timeout_ms % 1000) * 1000;
+            
+            FD_ZERO(&read);
+            FD_SET(m_socket, &read);
+            
+            if (wake >= 0)
+                FD_SET(wake, &read);
+            
+            int rc = select(std::max(m_socket, wake) + 1, &read, nullptr, nullptr, &timeout);
+            
+            if (rc < 0)
+                return errno == EINTR ? 0 : rc;
+            
+            return FD_ISSET(m_socket, &read) ? 1 : 0;
+#else
+            struct pollfd fds[2];
+            
+            fds[0].fd = m_socket;
+            fds[0].events = POLLIN;
+            fds[0].revents = 0;
+            fds[1].fd = m_wake;
+            fds[1].events = POLLIN;
+            fds[1].revents = 0;
+            
+            int rc = poll(fds, m_wake >= 0 ? 2 : 1, timeout_ms);
+            
+            if (rc < 0)
+                return errno == EINTR ? 0 : rc;
+            
+            if (fds[0].revents & POLLNVAL)
+                return -1;
+            
+            return fds[0].revents ? 1 : 0;
+#endif
+        }
+        
+    private:
         
-        timeout.tv_sec = timeout_secs;
-        timeout.tv_usec = timeout_usecs;
+        int m_socket;
+        int m_wake;
+#if defined(BONJOUR_FOR_CPP_WAIT_EPOLL)
+        int m_epoll;
+#endif
+    };
     
-        // Sets
-
-        FD_ZERO(&read);
-        FD_ZERO(&write);
-        FD_ZERO(&except);
+    // Set by the reply of the current thread when the daemon reports that more replies are coming
+    
+    inline bool& more_coming()
+    {
+        thread_local bool more = false;
+        return more;
+    }
+    
+    // Work deferred until the current thread has finished processing replies (and so holds no locks)
+    
+    inline std::vector<std::function<void()>>& deferred()
+    {
+        thread_local std::vector<std::function<void()>> tasks;
+        return tasks;
+    }
+    
+    // N.B. Tasks may defer further work, which is also run
+    
+    inline void run_deferred()
+    {
+        auto& tasks = deferred();
+        
+        while (!tasks.empty())
+        {
+            std::vector<std::function<void()>> batch;
+            std::swap(batch, tasks);
+            
+            for (auto it = batch.begin(); it != batch.end(); it++)
+                (*it)();
+        }
+    }
+    
+    // A generation counter that threads can wait on until it changes
+    // N.B. Callers should evaluate any conditions outside of the wait to avoid lock ordering issues
+    
+    template <class Mutex = std::mutex, class Condition = std::condition_variable>
+    class basic_change_signal
+    {
+    public:
+        
+        uint64_t generation() const
+        {
+            std::lock_guard<Mutex> lock(m_mutex);
+            return m_generation;
+        }
+        
+        void notify()
+        {
+            int wake;
+            
+            {
+                std::lock_guard<Mutex> lock(m_mutex);
+                m_generation++;
+                wake = m_wake;
+            }
+            
+            m_cond.notify_all();
+            
+            // N.B. The descriptor should be non-blocking (a full pipe is already readable, so the write can fail)
+            
+            char byte = 0;
+            
+            if (wake >= 0 && write(wake, &byte, 1) < 0)
+                return;
+        }
+        
+        // Also writes a byte to a descriptor on every change (so that poll-based loops can wait on the signal)
+        
+        void wake(int fd)
+        {
+            std::lock_guard<Mutex> lock(m_mutex);
+            m_wake = fd;
+        }
+        
+        template <class T>
+        bool wait_for_change(uint64_t generation, T deadline)
+        {
+            std::unique_lock<Mutex> lock(m_mutex);
+            return m_cond.wait_until(lock, deadline, [&](){ return m_generation != generation; });
+        }
+        
+    private:
+        
+        mutable Mutex m_mutex;
+        Condition m_cond;
+        uint64_t m_generation = 0;
+        int m_wake = -1;
+    };
+    
+    // The name of this host without any domain (or an empty string if it is unavailable)
+    // N.B. HOST_NAME_MAX is not available on every platform, so the buffer is sized with MAXHOSTNAMELEN
+    
+    inline std::string host_label()
+    {
+        char host[MAXHOSTNAMELEN + 1] = {};
+        
+        if (gethostname(host, MAXHOSTNAMELEN))
+            return std::string();
+        
+        return std::string(host, strcspn(host, "."));
+    }
+    
+    // DNS-SD service types are _name._tcp or _name._udp (optionally followed by subtypes as ,_subtype)
+    // Names are 1 to 15 letters, digits or hyphens (with at least one letter and no leading, trailing or double hyphens)
+    
+    constexpr bool is_letter(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+    
+    constexpr bool is_digit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+    
+    constexpr bool valid_regtype(const char *regtype)
+    {
+        if (!regtype || regtype[0] != '_')
+            return false;
+        
+        const char *c = regtype + 1;
+        size_t length = 0;
+        bool letter = false;
+        
+        for (; *c && *c != '.'; c++, length++)
+        {
+            if (*c == '-' && (!length || c[1] == '-' || c[1] == '.'))
+                return false;
             
-        FD_SET(socket, &read);
+            if (!is_letter(*c) && !is_digit(*c) && *c != '-')
+                return false;
             
-        return select(socket + 1, &read, &write, &except, &timeout);
+            letter = letter || is_letter(*c);
+        }
+        
+        if (!length || length > 15 || !letter || *c++ != '.')
+            return false;
+        
+        if (c[0] != '_' || !((c[1] == 't' && c[2] == 'c') || (c[1] == 'u' && c[2] == 'd')) || c[3] != 'p')
+            return false;
+        
+        c += 4;
+        
+        if (c[0] == '.' && !c[1])
+            return true;
+        
+        while (*c == ',')
+        {
+            for (length = 0, c++; *c && *c != ','; c++)
+                length++;
+            
+            if (!length || length > 63)
+                return false;
+        }
+        
+        return !*c;
     }
     
+    // A regtype with static storage (which objects refer to rather than copy)
+    
+    struct static_regtype
+    {
+        explicit constexpr static_regtype(const char *regtype) : m_regtype(regtype) {}
+        
+        const char *m_regtype;
+    };
+    
     std::string validate_name(const char *name)
     {
         return name;